@@ -14,14 +14,366 @@
 #include <dirent.h>
 #include <fstream>
 #include <map>
+#include <memory>
+#include <unordered_map>
+#include <optional>
+#include <algorithm>
+#include <fnmatch.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <csignal>
+#include <list>
+#include <unordered_set>
+#include <string_view>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
 
 using namespace std;
 
-// Builtin commands for autocompletion
-const vector<string> BUILTIN_COMMANDS = {"echo", "exit", "type", "pwd", "cd", "history"};
+// Builtin commands, in the same order as BUILTIN_NAMES
+enum class Builtin : uint8_t { Echo, Exit, Type, Pwd, Cd, History, True, False, Colon, Export, Break, Continue, Return, Cache, ShellStat, WatchRun, Alias, Unalias, Journal, None };
+
+constexpr size_t BUILTIN_COUNT = static_cast<size_t>(Builtin::None);
+constexpr std::array<std::string_view, BUILTIN_COUNT> BUILTIN_NAMES = {
+    "echo", "exit", "type", "pwd", "cd", "history", "true", "false", ":",
+    "export", "break", "continue", "return", "cache", "shellstat", "watch-run",
+    "alias", "unalias", "journal",
+};
+
+// FNV-1a with a chosen starting value, so a seed can be searched for at compile time
+constexpr uint32_t builtinHash(std::string_view name, uint32_t seed) {
+    uint32_t hash = seed;
+    for (char c : name) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+    }
+    return hash;
+}
+
+constexpr size_t BUILTIN_SLOTS = 64;
+
+// First seed for which every builtin name lands in a slot of its own
+constexpr uint32_t findBuiltinSeed() {
+    for (uint32_t seed = 2166136261u; seed < 2166136261u + 100000; ++seed) {
+        std::array<bool, BUILTIN_SLOTS> used{};
+        bool collision = false;
+        for (std::string_view name : BUILTIN_NAMES) {
+            size_t slot = builtinHash(name, seed) % BUILTIN_SLOTS;
+            collision = collision || used[slot];
+            used[slot] = true;
+        }
+        if (!collision) {
+            return seed;
+        }
+    }
+    return 0;
+}
+
+constexpr uint32_t BUILTIN_SEED = findBuiltinSeed();
+static_assert(BUILTIN_SEED != 0, "no perfect hash seed for the builtin names");
+
+// Perfect hash table from slot to builtin, filled at compile time
+constexpr std::array<Builtin, BUILTIN_SLOTS> BUILTIN_TABLE = [] {
+    std::array<Builtin, BUILTIN_SLOTS> table{};
+    table.fill(Builtin::None);
+    for (size_t i = 0; i < BUILTIN_COUNT; ++i) {
+        table[builtinHash(BUILTIN_NAMES[i], BUILTIN_SEED) % BUILTIN_SLOTS] = static_cast<Builtin>(i);
+    }
+    return table;
+}();
+
+// One hash and one string comparison, however many builtins there are
+Builtin lookupBuiltin(std::string_view name) {
+    Builtin builtin = BUILTIN_TABLE[builtinHash(name, BUILTIN_SEED) % BUILTIN_SLOTS];
+    if (builtin == Builtin::None || BUILTIN_NAMES[static_cast<size_t>(builtin)] != name) {
+        return Builtin::None;
+    }
+    return builtin;
+}
 
 // Forward declarations
-void executeCommand(const std::vector<std::string>& args);
+struct Program;
+void executeCommand(const std::vector<std::string>& args, const std::string& resolved);
+int runProgram(Program& program);
+int callFunction(Program& body, const std::vector<std::string>& args);
+[[noreturn]] void exitShell(int status);
+void enterSubshell();
+
+// Exit status of the most recently executed command ($?)
+int last_status = 0;
+
+// Shell variables that have not been exported to the environment
+std::unordered_map<std::string, std::string> shell_variables;
+
+// Positional parameters ($1, $2, ...) of the function currently executing
+std::vector<std::string> positional_params;
+
+// True in forked children (subshells, pipeline stages) that must not act as the top-level shell
+bool in_subshell = false;
+
+// Shell functions, compiled once when their definition is executed
+std::unordered_map<std::string, std::shared_ptr<Program>> shell_functions;
+
+// Log-linear latency histogram in the style of HdrHistogram: every power of
+// two is split into 16 linear sub-buckets, so recording is a couple of bit
+// operations and percentiles are accurate to about 6%
+struct LatencyHistogram {
+    static constexpr int SUB_BITS = 4;
+    static constexpr int SUB_COUNT = 1 << SUB_BITS;
+    std::array<uint64_t, 64 * SUB_COUNT> counts{};
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    static size_t bucketFor(uint64_t value) {
+        if (value < SUB_COUNT) {
+            return value;
+        }
+        int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return (shift + 1) * SUB_COUNT + ((value >> shift) & (SUB_COUNT - 1));
+    }
+
+    // Smallest value that falls into a bucket
+    static uint64_t bucketLow(size_t index) {
+        if (index < SUB_COUNT) {
+            return index;
+        }
+        int shift = index / SUB_COUNT - 1;
+        return static_cast<uint64_t>(SUB_COUNT + index % SUB_COUNT) << shift;
+    }
+
+    void record(uint64_t value) {
+        counts[bucketFor(value)]++;
+        total++;
+        sum += value;
+        max = std::max(max, value);
+    }
+
+    uint64_t percentile(double p) const {
+        uint64_t rank = static_cast<uint64_t>(p / 100.0 * total + 0.5);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            seen += counts[i];
+            if (seen >= std::max<uint64_t>(rank, 1)) {
+                return std::min(bucketLow(i), max);
+            }
+        }
+        return max;
+    }
+};
+
+// Always-on counters reported by the shellstat builtin
+struct ShellStats {
+    uint64_t commands = 0;
+    uint64_t forks = 0;
+    uint64_t failed_probes = 0;    // access() calls on PATH that found nothing
+    uint64_t path_hash_hits = 0;
+    uint64_t call_site_hits = 0;
+    uint64_t completions = 0;
+    std::array<uint64_t, 17> pipelines_by_depth{};  // Last slot counts 16 stages and more
+    LatencyHistogram completion_time;
+    LatencyHistogram launch_to_exec;
+    LatencyHistogram command_time;
+    LatencyHistogram watch_trigger_to_start;
+};
+ShellStats shell_stats;
+
+uint64_t monotonicNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t realtimeNanos() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t nanosFromTimeval(const struct timeval& tv) {
+    return static_cast<uint64_t>(tv.tv_sec) * 1000000000ull + tv.tv_usec * 1000ull;
+}
+
+// 64-bit FNV-1a, for history fingerprints and journal string ids
+uint64_t fingerprint64(std::string_view data) {
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : data) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Opt-in command journal. When SHELL_JOURNAL names a file, every process the
+// shell waits for appends one fixed-size record to it. Command lines and
+// directories are written once per session to FILE.strings as a 32-bit
+// length followed by the bytes, and records refer to them by offset.
+struct JournalRecord {
+    uint64_t time_ns;      // Wall clock time the process was started
+    uint64_t wall_ns;
+    uint64_t user_ns;
+    uint64_t sys_ns;
+    uint64_t argv_hash;
+    uint64_t argv_offset;  // Command line in the strings file
+    uint64_t cwd_offset;   // Working directory in the strings file, also its id
+    uint32_t max_rss_kb;
+    int32_t status;
+};
+static_assert(sizeof(JournalRecord) == 64, "journal records are 64 bytes");
+
+// The first record-sized block of the file holds only this magic
+constexpr char JOURNAL_MAGIC[8] = {'S', 'H', 'J', 'R', 'N', 'L', '0', '1'};
+
+struct JournalWriter {
+    std::string path;  // SHELL_JOURNAL the files were opened for
+    int records = -1;
+    int strings = -1;
+    std::unordered_map<uint64_t, uint64_t> offsets;  // String fingerprint -> offset
+};
+JournalWriter journal_writer;
+
+// Open the journal for the current SHELL_JOURNAL, false when journaling is off
+bool openJournal() {
+    char* path = getenv("SHELL_JOURNAL");
+    if (path != nullptr && *path != '\0' && journal_writer.path == path) {
+        return journal_writer.records != -1;
+    }
+    if (journal_writer.records != -1) {
+        close(journal_writer.records);
+        close(journal_writer.strings);
+    }
+    journal_writer = JournalWriter();
+    if (path == nullptr || *path == '\0') {
+        return false;
+    }
+    journal_writer.path = path;
+
+    int records = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    int strings = open((journal_writer.path + ".strings").c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (records == -1 || strings == -1) {
+        // Reported once, the path is remembered so later commands stay quiet
+        cerr << "shell: cannot open journal " << path << ": " << strerror(errno) << endl;
+        if (records != -1) {
+            close(records);
+        }
+        if (strings != -1) {
+            close(strings);
+        }
+        return false;
+    }
+    struct stat st;
+    if (fstat(records, &st) == 0 && st.st_size == 0) {
+        char header[sizeof(JournalRecord)] = {};
+        memcpy(header, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+        if (write(records, header, sizeof(header)) != sizeof(header)) {
+            close(records);
+            close(strings);
+            return false;
+        }
+    }
+    journal_writer.records = records;
+    journal_writer.strings = strings;
+    return true;
+}
+
+// Offset of a string in the strings file, appending it the first time it is seen
+uint64_t journalString(const std::string& text) {
+    uint64_t hash = fingerprint64(text);
+    auto it = journal_writer.offsets.find(hash);
+    if (it != journal_writer.offsets.end()) {
+        return it->second;
+    }
+    // One O_APPEND write lands in one piece even with several shells appending
+    uint32_t length = text.size();
+    string entry(reinterpret_cast<const char*>(&length), sizeof(length));
+    entry += text;
+    if (write(journal_writer.strings, entry.data(), entry.size()) != static_cast<ssize_t>(entry.size())) {
+        return UINT64_MAX;
+    }
+    uint64_t offset = lseek(journal_writer.strings, 0, SEEK_CUR) - entry.size();
+    journal_writer.offsets[hash] = offset;
+    return offset;
+}
+
+// Record a process the shell has just waited for
+void journalProcess(const std::vector<std::string>& args, uint64_t started, uint64_t wall_ns, int status, const struct rusage& usage) {
+    if (!openJournal()) {
+        return;
+    }
+    string command_line;
+    for (const string& arg : args) {
+        command_line += command_line.empty() ? arg : " " + arg;
+    }
+    char cwd[4096];
+
+    JournalRecord record = {};
+    record.time_ns = started;
+    record.wall_ns = wall_ns;
+    record.user_ns = nanosFromTimeval(usage.ru_utime);
+    record.sys_ns = nanosFromTimeval(usage.ru_stime);
+    record.argv_hash = fingerprint64(command_line);
+    record.argv_offset = journalString(command_line);
+    record.cwd_offset = journalString(getcwd(cwd, sizeof(cwd)) != nullptr ? cwd : "");
+    record.max_rss_kb = usage.ru_maxrss;
+    record.status = status;
+    if (write(journal_writer.records, &record, sizeof(record)) != sizeof(record)) {
+        cerr << "shell: cannot write journal " << journal_writer.path << ": " << strerror(errno) << endl;
+    }
+}
+
+// Executables on PATH by command name. Lookups fill it lazily, hashPath()
+// scans every PATH directory once for completion and for --serve.
+struct PathHash {
+    std::string path_env;
+    std::unordered_map<std::string, std::string> commands;
+    bool complete = false;
+};
+PathHash path_hash;
+
+// Return the PATH table, dropping it first if PATH changed since it was filled
+PathHash& currentPathHash() {
+    char* path = getenv("PATH");
+    string path_env = path != nullptr ? path : "";
+    if (path_hash.path_env != path_env) {
+        path_hash.path_env = path_env;
+        path_hash.commands.clear();
+        path_hash.complete = false;
+    }
+    return path_hash;
+}
+
+void hashPath() {
+    PathHash& hash = currentPathHash();
+    if (hash.complete) {
+        return;
+    }
+    istringstream pathStream(hash.path_env);
+    string dir;
+    while (getline(pathStream, dir, ':')) {
+        DIR* dirp = opendir(dir.c_str());
+        if (dirp == nullptr) {
+            continue;
+        }
+        struct dirent* entry;
+        while ((entry = readdir(dirp)) != nullptr) {
+            string filename(entry->d_name);
+            if (filename == "." || filename == ".." || hash.commands.count(filename)) {
+                continue;
+            }
+            string fullPath = dir + "/" + filename;
+            if (access(fullPath.c_str(), X_OK) == 0) {
+                hash.commands.emplace(filename, fullPath);
+            } else {
+                shell_stats.failed_probes++;
+            }
+        }
+        closedir(dirp);
+    }
+    hash.complete = true;
+}
 
 // Autocompletion function for readline
 char* builtin_completion(const char* text, int state) {
@@ -35,43 +387,26 @@ char* builtin_completion(const char* text, int state) {
         all_commands.clear();
         
         // Add builtin commands
-        for (const auto& cmd : BUILTIN_COMMANDS) {
-            if (strncmp(cmd.c_str(), text, len) == 0) {
-                all_commands.push_back(cmd);
+        for (std::string_view cmd : BUILTIN_NAMES) {
+            if (cmd.compare(0, len, text) == 0) {
+                all_commands.emplace_back(cmd);
             }
         }
         
         // Add external executables from PATH
-        char* path = getenv("PATH");
-        if (path != nullptr) {
-            string pathStr(path);
-            istringstream pathStream(pathStr);
-            string dir;
-            
-            while (getline(pathStream, dir, ':')) {
-                DIR* dirp = opendir(dir.c_str());
-                if (dirp != nullptr) {
-                    struct dirent* entry;
-                    while ((entry = readdir(dirp)) != nullptr) {
-                        string filename(entry->d_name);
-                        if (strncmp(filename.c_str(), text, len) == 0) {
-                            string fullPath = dir + "/" + filename;
-                            if (access(fullPath.c_str(), X_OK) == 0) {
-                                // Check if this executable is not already in the list
-                                bool found = false;
-                                for (const auto& existing : all_commands) {
-                                    if (existing == filename) {
-                                        found = true;
-                                        break;
-                                    }
-                                }
-                                if (!found) {
-                                    all_commands.push_back(filename);
-                                }
-                            }
-                        }
+        hashPath();
+        for (const auto& [filename, fullPath] : path_hash.commands) {
+            if (strncmp(filename.c_str(), text, len) == 0) {
+                // Check if this executable is not already in the list
+                bool found = false;
+                for (const auto& existing : all_commands) {
+                    if (existing == filename) {
+                        found = true;
+                        break;
                     }
-                    closedir(dirp);
+                }
+                if (!found) {
+                    all_commands.push_back(filename);
                 }
             }
         }
@@ -90,870 +425,4067 @@ char* builtin_completion(const char* text, int state) {
     return nullptr;
 }
 
+// Sorted directory listings for argument completion, keyed by absolute path and
+// revalidated with one stat() of the directory, so repeated Tab presses do not
+// re-read it. The least recently used listings are dropped past MAX_BYTES, and
+// a single listing larger than that is never cached.
+struct DirEntryInfo {
+    std::string name;
+    bool is_dir;
+};
+
+struct DirListing {
+    struct timespec mtime;
+    std::vector<DirEntryInfo> entries;  // Sorted by name
+    size_t bytes = 0;
+    std::list<std::string>::iterator lru_position;
+};
+
+struct DirListingCache {
+    static constexpr size_t MAX_BYTES = 4 << 20;
+    std::unordered_map<std::string, DirListing> listings;
+    std::list<std::string> lru;  // Most recently used first
+    size_t bytes = 0;
+    DirListing uncached;         // A listing over MAX_BYTES, kept only until releaseUncached()
+
+    void drop(const std::string& key) {
+        auto it = listings.find(key);
+        bytes -= it->second.bytes;
+        lru.erase(it->second.lru_position);
+        listings.erase(it);
+    }
+
+    const DirListing* get(const std::string& dir) {
+        string key = dir;
+        if (key[0] != '/') {
+            char cwd[4096];
+            if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+                return nullptr;
+            }
+            key = string(cwd) + "/" + dir;
+        }
+        struct stat st;
+        if (stat(key.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+            return nullptr;
+        }
+
+        auto cached = listings.find(key);
+        if (cached != listings.end()) {
+            DirListing& listing = cached->second;
+            if (listing.mtime.tv_sec == st.st_mtim.tv_sec && listing.mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                lru.splice(lru.begin(), lru, listing.lru_position);
+                return &listing;
+            }
+            drop(key);
+        }
+
+        DIR* dirp = opendir(key.c_str());
+        if (dirp == nullptr) {
+            return nullptr;
+        }
+        DirListing listing;
+        listing.mtime = st.st_mtim;
+        struct dirent* entry;
+        while ((entry = readdir(dirp)) != nullptr) {
+            string name(entry->d_name);
+            if (name == "." || name == "..") {
+                continue;
+            }
+            bool is_dir = entry->d_type == DT_DIR;
+            if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK) {
+                struct stat target;
+                is_dir = stat((key + "/" + name).c_str(), &target) == 0 && S_ISDIR(target.st_mode);
+            }
+            listing.bytes += sizeof(DirEntryInfo) + name.size();
+            listing.entries.push_back({std::move(name), is_dir});
+        }
+        closedir(dirp);
+        std::sort(listing.entries.begin(), listing.entries.end(), [](const DirEntryInfo& a, const DirEntryInfo& b) {
+            return a.name < b.name;
+        });
+
+        // A directory bigger than the whole cache is served without evicting anything
+        if (listing.bytes > MAX_BYTES) {
+            uncached = std::move(listing);
+            return &uncached;
+        }
+        while (!lru.empty() && bytes + listing.bytes > MAX_BYTES) {
+            drop(lru.back());
+        }
+        lru.push_front(key);
+        listing.lru_position = lru.begin();
+        bytes += listing.bytes;
+        return &(listings[key] = std::move(listing));
+    }
+
+    void releaseUncached() {
+        uncached = DirListing();
+    }
+};
+DirListingCache dir_listing_cache;
+
+// Set by the completion dispatcher: cd only completes directories
+bool complete_dirs_only = false;
+
+// Argument completion for files and directories, served from dir_listing_cache
+char* path_completion(const char* text, int state) {
+    static vector<string> matches;
+    static size_t list_index;
+
+    if (!state) {
+        list_index = 0;
+        matches.clear();
+
+        string word(text);
+        size_t slash = word.rfind('/');
+        string prefix_dir = slash == string::npos ? "" : word.substr(0, slash + 1);
+        string base = slash == string::npos ? word : word.substr(slash + 1);
+        string dir = prefix_dir.empty() ? "." : prefix_dir;
+        char* home = getenv("HOME");
+        if (dir[0] == '~' && home != nullptr && (dir.size() == 1 || dir[1] == '/')) {
+            dir = home + dir.substr(1);
+        }
+
+        const DirListing* listing = dir_listing_cache.get(dir);
+        if (listing != nullptr) {
+            // Entries are sorted, so the matches are one contiguous run
+            auto it = std::lower_bound(listing->entries.begin(), listing->entries.end(), base,
+                                       [](const DirEntryInfo& entry, const string& key) { return entry.name < key; });
+            for (; it != listing->entries.end() && it->name.compare(0, base.size(), base) == 0; ++it) {
+                if ((complete_dirs_only && !it->is_dir) || (base.empty() && it->name[0] == '.')) {
+                    continue;
+                }
+                matches.push_back(prefix_dir + it->name);
+            }
+        }
+        dir_listing_cache.releaseUncached();
+    }
+
+    if (list_index < matches.size()) {
+        return strdup(matches[list_index++].c_str());
+    }
+    return nullptr;
+}
+
 // Function to generate completions
 char** builtin_completion_generator(const char* text, int start, int end) {
     char** matches = nullptr;
+    uint64_t started = monotonicNanos();
     
     if (start == 0) {
         matches = rl_completion_matches(text, builtin_completion);
+    } else {
+        // Arguments complete to paths; readline's own fallback would re-read the directory
+        string line(rl_line_buffer, start);
+        size_t first = line.find_first_not_of(" \t");
+        string command = first == string::npos ? "" : line.substr(first, line.find_first_of(" \t", first) - first);
+        complete_dirs_only = command == "cd";
+        rl_filename_completion_desired = 1;
+        rl_attempted_completion_over = 1;
+        matches = rl_completion_matches(text, path_completion);
     }
     
+    shell_stats.completions++;
+    shell_stats.completion_time.record(monotonicNanos() - started);
     return matches;
 }
 
+// Redirection operators: n>, n>>, n<, n>&m, n<&m, &> and &>>
+enum class RedirectOp { Out, Append, In, DupOut, DupIn, OutErr, AppendErr };
+
+// A redirection with its target word already expanded
+struct Redirection {
+    int fd;
+    RedirectOp op;
+    std::string target;
+};
+
 struct ParsedCommand {
     std::vector<std::string> args;
-    std::string output_file;
-    std::string error_file;
-    bool has_redirection;
-    bool has_stderr_redirection;
-    bool has_append_redirection;
-    bool has_stderr_append_redirection;
-    bool is_pipeline;
+    std::vector<Redirection> redirections;
+    bool is_pipeline = false;
     std::vector<std::vector<std::string>> pipeline_commands;
+    std::vector<std::vector<Redirection>> pipeline_redirections;
+    // Compiled bodies for compound pipeline stages, nullptr for simple commands
+    std::vector<std::shared_ptr<Program>> pipeline_bodies;
+    // Leading NAME=value words of each simple stage, exported only in that stage's child
+    std::vector<std::vector<std::pair<std::string, std::string>>> pipeline_assignments;
+    // Executable each simple stage resolved to in the parent, empty for builtins, functions and unknown commands
+    std::vector<std::string> pipeline_paths;
 };
 
-std::vector<std::string> parseArgs(const std::string& input) {
-    std::vector<std::string> args;
-    std::string current;
-    bool in_single_quote = false;
-    bool in_double_quote = false;
-    bool escaped = false;
+// Token types produced by the lexer
+enum class TokenType { Word, Redirect, Semi, DoubleSemi, Newline, Pipe, AndIf, OrIf, LParen, RParen, End };
 
-    for (size_t i = 0; i < input.size(); ++i) {
-        char c = input[i];
+// A run of characters inside a word: either literal text or a $parameter reference
+struct WordPart {
+    bool is_param;
+    bool quoted;
+    std::string text;
+};
 
-        // Special handling for backslash inside double quotes
-        if (in_double_quote && c == '\\') {
-            if (i + 1 < input.size() && (input[i + 1] == '\\' || input[i + 1] == '$' || input[i + 1] == '"' || input[i + 1] == '\n')) {
-                current += input[i + 1];
-                ++i;
-            } else {
-                current += '\\';
-            }
-            continue;
-        }
-        
-        if (escaped) {
-            current += c;
-            escaped = false;
-            continue;
-        }
+struct Word {
+    std::vector<WordPart> parts;
+    std::string literal;  // Text with quotes removed, only meaningful when has_params is false
+    bool has_params = false;
+    bool has_quotes = false;
+};
 
-        if (c == '\\') {
-            if (in_single_quote) {
-                // In single quotes, backslash is treated as a literal character
-                current += c;
-            } else if (in_double_quote) {
-                // Already handled above
-                // (This branch will not be reached)
-            } else {
-                // In unquoted context, escape next character
-                escaped = true;
-            }
-        } else if (c == '\'' && !in_double_quote) {
-            in_single_quote = !in_single_quote;
-        } else if (c == '"' && !in_single_quote) {
-            in_double_quote = !in_double_quote;
-        } else if (std::isspace(c) && !in_single_quote && !in_double_quote) {
-            if (!current.empty()) {
-                args.push_back(current);
-                current.clear();
-            }
-        } else {
-            current += c;
-        }
-    }
+// The aliases whose expansion a token came from, innermost first
+struct AliasScope {
+    std::string name;
+    std::shared_ptr<const AliasScope> outer;
+};
 
-    if (!current.empty()) {
-        args.push_back(current);
+struct Token {
+    TokenType type;
+    Word word;
+    int fd = -1;  // Redirect: descriptor being redirected
+    RedirectOp redirect = RedirectOp::Out;
+    std::shared_ptr<const AliasScope> alias_scope;  // Set on tokens spliced in by an alias
+};
+
+// A redirection as written, with its target still unexpanded
+struct Redirect {
+    int fd;
+    RedirectOp op;
+    Word target;
+};
+
+enum class ParseStatus { Ok, Incomplete, Error };
+
+// Append a literal character to a word, merging it into the previous part when possible
+void appendLiteral(Word& word, char c, bool quoted) {
+    if (word.parts.empty() || word.parts.back().is_param || word.parts.back().quoted != quoted) {
+        word.parts.push_back({false, quoted, ""});
     }
+    word.parts.back().text += c;
+    word.literal += c;
+}
 
-    return args;
+// Lex a $name, ${name} or special parameter at input[i], returning the index after it
+size_t lexParameter(const std::string& input, size_t i, Word& word, bool quoted) {
+    size_t j = i + 1;
+    std::string name;
+    if (j < input.size() && input[j] == '{') {
+        size_t close = input.find('}', j + 1);
+        if (close == std::string::npos) {
+            return std::string::npos;
+        }
+        name = input.substr(j + 1, close - j - 1);
+        j = close + 1;
+    } else if (j < input.size() && (std::isalpha(static_cast<unsigned char>(input[j])) || input[j] == '_')) {
+        while (j < input.size() && (std::isalnum(static_cast<unsigned char>(input[j])) || input[j] == '_')) {
+            name += input[j++];
+        }
+    } else if (j < input.size() && (std::isdigit(static_cast<unsigned char>(input[j])) || std::string("?#$@*").find(input[j]) != std::string::npos)) {
+        name = input[j++];
+    } else {
+        // A lone '$' is literal
+        appendLiteral(word, '$', quoted);
+        return j;
+    }
+    word.parts.push_back({true, quoted, name});
+    word.has_params = true;
+    return j;
 }
 
-ParsedCommand parseCommandWithRedirection(const std::string& input) {
-    ParsedCommand result;
-    result.has_redirection = false;
-    result.has_stderr_redirection = false;
-    result.has_append_redirection = false;
-    result.has_stderr_append_redirection = false;
-    result.is_pipeline = false;
-    
-    std::vector<std::string> args = parseArgs(input);
-    
-    // Check for pipeline first
-    for (size_t i = 0; i < args.size(); ++i) {
-        if (args[i] == "|") {
-            result.is_pipeline = true;
-            
-            // Split into pipeline commands
-            std::vector<std::string> current_command;
-            for (size_t j = 0; j < i; ++j) {
-                current_command.push_back(args[j]);
+// Split input into words and operators, keeping track of quoting for later expansion
+ParseStatus tokenize(const std::string& input, std::vector<Token>& tokens, std::string& error) {
+    Word word;
+    bool in_word = false;
+
+    auto flushWord = [&]() {
+        if (in_word) {
+            tokens.push_back({TokenType::Word, std::move(word)});
+            word = Word();
+            in_word = false;
+        }
+    };
+    auto pushOperator = [&](TokenType type) {
+        flushWord();
+        tokens.push_back({type, Word()});
+    };
+    auto pushRedirect = [&](int default_fd, RedirectOp op) {
+        // An unquoted run of digits right before the operator names the descriptor
+        int fd = default_fd;
+        if (in_word && !word.has_params && !word.has_quotes && word.literal.size() < 4 &&
+            word.literal.find_first_not_of("0123456789") == std::string::npos) {
+            fd = stoi(word.literal);
+            word = Word();
+            in_word = false;
+        }
+        flushWord();
+        Token token{TokenType::Redirect, Word()};
+        token.fd = fd;
+        token.redirect = op;
+        tokens.push_back(std::move(token));
+    };
+
+    size_t i = 0;
+    while (i < input.size()) {
+        char c = input[i];
+
+        if (c == '\\') {
+            // A trailing backslash continues the command on the next line
+            if (i + 1 >= input.size()) {
+                return ParseStatus::Incomplete;
             }
-            if (!current_command.empty()) {
-                result.pipeline_commands.push_back(current_command);
+            if (input[i + 1] != '\n') {
+                appendLiteral(word, input[i + 1], true);
+                in_word = true;
             }
-            
-            current_command.clear();
-            for (size_t j = i + 1; j < args.size(); ++j) {
-                if (args[j] == "|") {
-                    if (!current_command.empty()) {
-                        result.pipeline_commands.push_back(current_command);
-                        current_command.clear();
+            i += 2;
+        } else if (c == '\'') {
+            // In single quotes, every character is literal
+            size_t close = input.find('\'', i + 1);
+            if (close == std::string::npos) {
+                return ParseStatus::Incomplete;
+            }
+            word.parts.push_back({false, true, ""});
+            word.has_quotes = true;
+            in_word = true;
+            for (size_t k = i + 1; k < close; ++k) {
+                appendLiteral(word, input[k], true);
+            }
+            i = close + 1;
+        } else if (c == '"') {
+            word.parts.push_back({false, true, ""});
+            word.has_quotes = true;
+            in_word = true;
+            ++i;
+            while (true) {
+                if (i >= input.size()) {
+                    return ParseStatus::Incomplete;
+                }
+                char d = input[i];
+                if (d == '"') {
+                    ++i;
+                    break;
+                }
+                // Inside double quotes backslash only escapes \ $ " and newline
+                if (d == '\\' && i + 1 < input.size() && (input[i + 1] == '\\' || input[i + 1] == '$' || input[i + 1] == '"' || input[i + 1] == '\n')) {
+                    if (input[i + 1] != '\n') {
+                        appendLiteral(word, input[i + 1], true);
+                    }
+                    i += 2;
+                } else if (d == '$') {
+                    i = lexParameter(input, i, word, true);
+                    if (i == std::string::npos) {
+                        error = "bad substitution";
+                        return ParseStatus::Error;
                     }
                 } else {
-                    current_command.push_back(args[j]);
+                    appendLiteral(word, d, true);
+                    ++i;
                 }
             }
-            if (!current_command.empty()) {
-                result.pipeline_commands.push_back(current_command);
+        } else if (c == '$') {
+            i = lexParameter(input, i, word, false);
+            if (i == std::string::npos) {
+                error = "bad substitution";
+                return ParseStatus::Error;
             }
-            
-            return result;
-        }
-    }
-    
-    // No pipeline, check for redirection
-    for (size_t i = 0; i < args.size(); ++i) {
-        if (args[i] == ">" || args[i] == "1>") {
-            if (i + 1 < args.size()) {
-                result.output_file = args[i + 1];
-                result.has_redirection = true;
-                // Add all arguments before the redirection operator
-                for (size_t j = 0; j < i; ++j) {
-                    result.args.push_back(args[j]);
-                }
-                return result;
-            }
-        } else if (args[i] == "2>" || args[i] == "2>&1") {
-            if (i + 1 < args.size()) {
-                result.error_file = args[i + 1];
-                result.has_stderr_redirection = true;
-                // Add all arguments before the redirection operator
-                for (size_t j = 0; j < i; ++j) {
-                    result.args.push_back(args[j]);
-                }
-                return result;
-            }
-        } else if (args[i] == "2>>") {
-            if (i + 1 < args.size()) {
-                result.error_file = args[i + 1];
-                result.has_stderr_append_redirection = true;
-                // Add all arguments before the redirection operator
-                for (size_t j = 0; j < i; ++j) {
-                    result.args.push_back(args[j]);
-                }
-                return result;
-            }
-        } else if (args[i] == ">>" || args[i] == "1>>") {
-            if (i + 1 < args.size()) {
-                result.output_file = args[i + 1];
-                result.has_append_redirection = true;
-                // Add all arguments before the redirection operator
-                for (size_t j = 0; j < i; ++j) {
-                    result.args.push_back(args[j]);
-                }
-                return result;
+            in_word = true;
+        } else if (c == '#' && !in_word) {
+            // Comment runs to the end of the line
+            while (i < input.size() && input[i] != '\n') {
+                ++i;
+            }
+        } else if (c == '\n') {
+            pushOperator(TokenType::Newline);
+            ++i;
+        } else if (std::isspace(static_cast<unsigned char>(c))) {
+            flushWord();
+            ++i;
+        } else if (c == ';') {
+            if (i + 1 < input.size() && input[i + 1] == ';') {
+                pushOperator(TokenType::DoubleSemi);
+                i += 2;
+            } else {
+                pushOperator(TokenType::Semi);
+                ++i;
+            }
+        } else if (c == '|') {
+            if (i + 1 < input.size() && input[i + 1] == '|') {
+                pushOperator(TokenType::OrIf);
+                i += 2;
+            } else {
+                pushOperator(TokenType::Pipe);
+                ++i;
+            }
+        } else if (c == '&' && i + 1 < input.size() && input[i + 1] == '&') {
+            pushOperator(TokenType::AndIf);
+            i += 2;
+        } else if (c == '&' && i + 1 < input.size() && input[i + 1] == '>') {
+            bool append = i + 2 < input.size() && input[i + 2] == '>';
+            pushRedirect(STDOUT_FILENO, append ? RedirectOp::AppendErr : RedirectOp::OutErr);
+            i += append ? 3 : 2;
+        } else if (c == '>') {
+            char next = i + 1 < input.size() ? input[i + 1] : '\0';
+            if (next == '>') {
+                pushRedirect(STDOUT_FILENO, RedirectOp::Append);
+                i += 2;
+            } else if (next == '&') {
+                pushRedirect(STDOUT_FILENO, RedirectOp::DupOut);
+                i += 2;
+            } else {
+                pushRedirect(STDOUT_FILENO, RedirectOp::Out);
+                i += next == '|' ? 2 : 1;
             }
+        } else if (c == '<') {
+            bool dup = i + 1 < input.size() && input[i + 1] == '&';
+            pushRedirect(STDIN_FILENO, dup ? RedirectOp::DupIn : RedirectOp::In);
+            i += dup ? 2 : 1;
+        } else if (c == '(') {
+            pushOperator(TokenType::LParen);
+            ++i;
+        } else if (c == ')') {
+            pushOperator(TokenType::RParen);
+            ++i;
+        } else {
+            appendLiteral(word, c, false);
+            in_word = true;
+            ++i;
         }
     }
-    
-    // No redirection found, return all arguments
-    result.args = args;
-    return result;
+
+    flushWord();
+    tokens.push_back({TokenType::End, Word()});
+    return ParseStatus::Ok;
 }
 
-void handleRedirection(const ParsedCommand& command) {
-    if (command.has_redirection) {
-        int fd = open(command.output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1) {
-            cerr << "Error opening file for redirection: " << command.output_file << endl;
-            exit(1);
-        }
-        // Redirect stdout to the file
-        if (dup2(fd, STDOUT_FILENO) == -1) {
-            cerr << "Error redirecting stdout" << endl;
-            exit(1);
-        }
+// Convert a waitpid() status into a shell exit status
+int decodeWaitStatus(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return 1;
+}
+
+// The redirections of one command resolved to descriptor moves. Each move makes
+// `target` a copy of `source` (or closes it when source is -1) and moves are
+// applied in order, so "2>&1 >file" and ">file 2>&1" behave differently. The
+// same plan is used as posix_spawn file actions, applied with dup2() in a forked
+// child, or applied around a builtin with the previous descriptors saved.
+struct FdPlan {
+    std::vector<std::pair<int, int>> moves;
+    std::vector<int> opened;                 // Files opened for the plan, all O_CLOEXEC
+    std::vector<std::pair<int, int>> saved;  // Target and its saved copy, -1 if it was closed
+};
+
+// Close the files opened for a plan once their descriptors have been duplicated
+void closeFdPlan(FdPlan& plan) {
+    for (int fd : plan.opened) {
         close(fd);
     }
-    
-    if (command.has_append_redirection) {
-        int fd = open(command.output_file.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    plan.opened.clear();
+}
+
+// Open every file a list of redirections refers to, returning false on failure
+bool openFdPlan(const std::vector<Redirection>& redirections, FdPlan& plan) {
+    for (const Redirection& redirection : redirections) {
+        int flags = -1;
+        switch (redirection.op) {
+            case RedirectOp::Out:
+            case RedirectOp::OutErr:
+                flags = O_WRONLY | O_CREAT | O_TRUNC;
+                break;
+            case RedirectOp::Append:
+            case RedirectOp::AppendErr:
+                flags = O_WRONLY | O_CREAT | O_APPEND;
+                break;
+            case RedirectOp::In:
+                flags = O_RDONLY;
+                break;
+            case RedirectOp::DupOut:
+            case RedirectOp::DupIn:
+                break;
+        }
+
+        if (flags == -1) {
+            // n>&m duplicates an existing descriptor, n>&- closes it
+            const string& target = redirection.target;
+            if (target == "-") {
+                plan.moves.emplace_back(redirection.fd, -1);
+            } else if (!target.empty() && target.find_first_not_of("0123456789") == string::npos) {
+                // The source must be open by the time this move applies: either an
+                // earlier redirection in the plan set it up, or the shell has it now
+                int source = stoi(target);
+                int state = fcntl(source, F_GETFD);
+                for (const auto& move : plan.moves) {
+                    if (move.first == source) {
+                        state = move.second;
+                    }
+                }
+                if (state == -1) {
+                    cerr << target << ": Bad file descriptor" << endl;
+                    closeFdPlan(plan);
+                    return false;
+                }
+                plan.moves.emplace_back(redirection.fd, source);
+            } else {
+                cerr << target << ": ambiguous redirect" << endl;
+                closeFdPlan(plan);
+                return false;
+            }
+            continue;
+        }
+
+        int fd = open(redirection.target.c_str(), flags | O_CLOEXEC, 0644);
         if (fd == -1) {
-            cerr << "Error opening file for append redirection: " << command.output_file << endl;
-            exit(1);
+            cerr << "Error opening file for redirection: " << redirection.target << endl;
+            closeFdPlan(plan);
+            return false;
         }
-        // Redirect stdout to the file
-        if (dup2(fd, STDOUT_FILENO) == -1) {
-            cerr << "Error redirecting stdout" << endl;
-            exit(1);
+        plan.opened.push_back(fd);
+        plan.moves.emplace_back(redirection.fd, fd);
+        if (redirection.op == RedirectOp::OutErr || redirection.op == RedirectOp::AppendErr) {
+            plan.moves.emplace_back(STDERR_FILENO, fd);
         }
-        close(fd);
     }
-    
-    if (command.has_stderr_redirection) {
-        int fd = open(command.error_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1) {
-            cerr << "Error opening file for stderr redirection: " << command.error_file << endl;
-            exit(1);
+
+    // A freshly opened file can land on a descriptor that is also a target (e.g.
+    // "3>a 4>b" with 3 free); move it out of the way so applying stays in order
+    for (int& fd : plan.opened) {
+        bool clashes = false;
+        for (const auto& [target, source] : plan.moves) {
+            clashes = clashes || target == fd;
         }
-        // Redirect stderr to the file
-        if (dup2(fd, STDERR_FILENO) == -1) {
-            cerr << "Error redirecting stderr" << endl;
-            exit(1);
+        if (!clashes) {
+            continue;
+        }
+        int moved = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+        for (auto& move : plan.moves) {
+            if (move.second == fd) {
+                move.second = moved;
+            }
         }
         close(fd);
+        fd = moved;
     }
-    
-    if (command.has_stderr_append_redirection) {
-        int fd = open(command.error_file.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
-        if (fd == -1) {
-            cerr << "Error opening file for stderr append redirection: " << command.error_file << endl;
+    return true;
+}
+
+// Apply a plan in a forked child; the opened files are O_CLOEXEC so exec drops them
+void applyFdPlanInChild(const FdPlan& plan) {
+    for (const auto& [target, source] : plan.moves) {
+        if (source == -1) {
+            close(target);
+        } else if (source != target && dup2(source, target) == -1) {
+            cerr << "Error redirecting file descriptor " << target << endl;
             exit(1);
         }
-        // Redirect stderr to the file
-        if (dup2(fd, STDERR_FILENO) == -1) {
-            cerr << "Error redirecting stderr" << endl;
-            exit(1);
+    }
+}
+
+// Record a plan as file actions for posix_spawn()
+void addSpawnActions(const FdPlan& plan, posix_spawn_file_actions_t* actions) {
+    for (const auto& [target, source] : plan.moves) {
+        if (source == -1) {
+            posix_spawn_file_actions_addclose(actions, target);
+        } else if (source != target) {
+            posix_spawn_file_actions_adddup2(actions, source, target);
         }
-        close(fd);
     }
 }
 
-struct RedirectionState {
-    int original_stdout;
-    int original_stderr;
-    bool has_stdout_redirection;
-    bool has_stderr_redirection;
-    bool has_append_redirection;
-    bool has_stderr_append_redirection;
-    
-    RedirectionState() : original_stdout(-1), original_stderr(-1), 
-                        has_stdout_redirection(false), has_stderr_redirection(false),
-                        has_append_redirection(false), has_stderr_append_redirection(false) {}
-};
-
-RedirectionState handleBuiltinRedirection(const ParsedCommand& command) {
-    RedirectionState state;
-    
-    if (command.has_redirection) {
-        state.has_stdout_redirection = true;
-        // Save original stdout
-        state.original_stdout = dup(STDOUT_FILENO);
-        if (state.original_stdout == -1) {
-            cerr << "Error saving stdout" << endl;
-            return state;
-        }
-        
-        int fd = open(command.output_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1) {
-            cerr << "Error opening file for redirection: " << command.output_file << endl;
-            close(state.original_stdout);
-            state.original_stdout = -1;
-            return state;
-        }
-        // Redirect stdout to the file
-        if (dup2(fd, STDOUT_FILENO) == -1) {
-            cerr << "Error redirecting stdout" << endl;
-            close(fd);
-            close(state.original_stdout);
-            state.original_stdout = -1;
-            return state;
-        }
-        close(fd);
-    }
-    
-    if (command.has_append_redirection) {
-        state.has_append_redirection = true;
-        // Save original stdout
-        state.original_stdout = dup(STDOUT_FILENO);
-        if (state.original_stdout == -1) {
-            cerr << "Error saving stdout" << endl;
-            return state;
-        }
-        
-        int fd = open(command.output_file.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
-        if (fd == -1) {
-            cerr << "Error opening file for append redirection: " << command.output_file << endl;
-            close(state.original_stdout);
-            state.original_stdout = -1;
-            return state;
-        }
-        // Redirect stdout to the file
-        if (dup2(fd, STDOUT_FILENO) == -1) {
-            cerr << "Error redirecting stdout" << endl;
-            close(fd);
-            close(state.original_stdout);
-            state.original_stdout = -1;
-            return state;
-        }
-        close(fd);
-    }
-    
-    if (command.has_stderr_redirection) {
-        state.has_stderr_redirection = true;
-        // Save original stderr
-        state.original_stderr = dup(STDERR_FILENO);
-        if (state.original_stderr == -1) {
-            cerr << "Error saving stderr" << endl;
-            if (state.original_stdout != -1) {
-                close(state.original_stdout);
-                state.original_stdout = -1;
-            }
-            return state;
-        }
-        
-        int fd = open(command.error_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (fd == -1) {
-            cerr << "Error opening file for stderr redirection: " << command.error_file << endl;
-            if (state.original_stdout != -1) {
-                close(state.original_stdout);
-                state.original_stdout = -1;
-            }
-            close(state.original_stderr);
-            state.original_stderr = -1;
-            return state;
-        }
-        // Redirect stderr to the file
-        if (dup2(fd, STDERR_FILENO) == -1) {
-            cerr << "Error redirecting stderr" << endl;
-            close(fd);
-            if (state.original_stdout != -1) {
-                close(state.original_stdout);
-                state.original_stdout = -1;
-            }
-            close(state.original_stderr);
-            state.original_stderr = -1;
-            return state;
+// Apply a plan in the shell process itself, saving each target for restoreFdPlan()
+void applyFdPlan(FdPlan& plan) {
+    cout.flush();
+    for (const auto& [target, source] : plan.moves) {
+        bool already_saved = false;
+        for (const auto& entry : plan.saved) {
+            already_saved = already_saved || entry.first == target;
         }
-        close(fd);
-    }
-    
-    if (command.has_stderr_append_redirection) {
-        state.has_stderr_append_redirection = true;
-        // Save original stderr
-        state.original_stderr = dup(STDERR_FILENO);
-        if (state.original_stderr == -1) {
-            cerr << "Error saving stderr" << endl;
-            if (state.original_stdout != -1) {
-                close(state.original_stdout);
-                state.original_stdout = -1;
-            }
-            return state;
+        if (!already_saved) {
+            plan.saved.emplace_back(target, fcntl(target, F_DUPFD_CLOEXEC, 10));
         }
-        
-        int fd = open(command.error_file.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
-        if (fd == -1) {
-            cerr << "Error opening file for stderr append redirection: " << command.error_file << endl;
-            if (state.original_stdout != -1) {
-                close(state.original_stdout);
-                state.original_stdout = -1;
-            }
-            close(state.original_stderr);
-            state.original_stderr = -1;
-            return state;
-        }
-        // Redirect stderr to the file
-        if (dup2(fd, STDERR_FILENO) == -1) {
-            cerr << "Error redirecting stderr" << endl;
-            close(fd);
-            if (state.original_stdout != -1) {
-                close(state.original_stdout);
-                state.original_stdout = -1;
-            }
-            close(state.original_stderr);
-            state.original_stderr = -1;
-            return state;
+        if (source == -1) {
+            close(target);
+        } else if (source != target) {
+            dup2(source, target);
         }
-        close(fd);
     }
-    
-    return state;
+    closeFdPlan(plan);
 }
 
-void restoreRedirection(const RedirectionState& state) {
-    if ((state.has_stdout_redirection || state.has_append_redirection) && state.original_stdout != -1) {
-        dup2(state.original_stdout, STDOUT_FILENO);
-        close(state.original_stdout);
-    }
-    if ((state.has_stderr_redirection || state.has_stderr_append_redirection) && state.original_stderr != -1) {
-        dup2(state.original_stderr, STDERR_FILENO);
-        close(state.original_stderr);
+void restoreFdPlan(FdPlan& plan) {
+    cout.flush();
+    for (auto it = plan.saved.rbegin(); it != plan.saved.rend(); ++it) {
+        if (it->second == -1) {
+            close(it->first);
+        } else {
+            dup2(it->second, it->first);
+            close(it->second);
+        }
     }
+    plan.saved.clear();
+    // A write while stdout was closed leaves cout failed; it works again now
+    cout.clear();
 }
 
-void executePipeline(const ParsedCommand& command) {
+int executePipeline(const ParsedCommand& command) {
     int n = command.pipeline_commands.size();
     if (n < 2) {
         cerr << "Pipeline must have at least 2 commands" << endl;
-        return;
-    }
-    
-    // Create pipes for n-1 connections
-    std::vector<std::array<int, 2>> pipes(n - 1);
-    for (int i = 0; i < n - 1; ++i) {
-        if (pipe(pipes[i].data()) == -1) {
-            cerr << "Error creating pipe" << endl;
-            return;
-        }
+        return 1;
     }
     
     std::vector<pid_t> pids;
+    pids.reserve(n);
+    std::vector<std::pair<uint64_t, uint64_t>> start_times;  // Wall clock and monotonic, for the journal
+    start_times.reserve(n);
+    
+    shell_stats.pipelines_by_depth[std::min<size_t>(n, shell_stats.pipelines_by_depth.size() - 1)]++;
     
-    // Fork a process for each command
+    // Pipes are created one stage ahead, so the parent never holds more than
+    // the read end for the next stage and the pipe being wired up
+    int prev_read = -1;
     for (int i = 0; i < n; ++i) {
+        int next[2] = {-1, -1};
+        if (i < n - 1 && pipe2(next, O_CLOEXEC) == -1) {
+            cerr << "Error creating pipe: " << strerror(errno) << endl;
+            if (prev_read != -1) {
+                close(prev_read);
+            }
+            for (pid_t child_pid : pids) {
+                waitpid(child_pid, nullptr, 0);
+            }
+            return 1;
+        }
+
+        shell_stats.forks++;
+        start_times.emplace_back(realtimeNanos(), monotonicNanos());
         pid_t pid = fork();
         if (pid == 0) {
             // Child process
+            enterSubshell();
             
-            // Set up stdin (read from previous pipe or shell stdin)
-            if (i > 0) {
-                if (dup2(pipes[i - 1][0], STDIN_FILENO) == -1) {
+            // dup2() clears close-on-exec on the copy, the originals close at exec
+            if (prev_read != -1) {
+                if (dup2(prev_read, STDIN_FILENO) == -1) {
                     cerr << "Error redirecting stdin in pipeline" << endl;
                     exit(1);
                 }
+                close(prev_read);
             }
-            
-            // Set up stdout (write to next pipe or shell stdout)
-            if (i < n - 1) {
-                if (dup2(pipes[i][1], STDOUT_FILENO) == -1) {
+            if (next[1] != -1) {
+                if (dup2(next[1], STDOUT_FILENO) == -1) {
                     cerr << "Error redirecting stdout in pipeline" << endl;
                     exit(1);
                 }
+                close(next[0]);
+                close(next[1]);
+            }
+            
+            // Apply this stage's own redirections on top of the pipe wiring
+            if (i < (int)command.pipeline_redirections.size() && !command.pipeline_redirections[i].empty()) {
+                FdPlan plan;
+                if (!openFdPlan(command.pipeline_redirections[i], plan)) {
+                    exit(1);
+                }
+                applyFdPlanInChild(plan);
             }
             
-            // Close all pipe file descriptors in child
-            for (int j = 0; j < n - 1; ++j) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
+            // Compound stages run their compiled body in the child
+            if (i < (int)command.pipeline_bodies.size() && command.pipeline_bodies[i]) {
+                exit(runProgram(*command.pipeline_bodies[i]));
             }
             
+            if (i < (int)command.pipeline_assignments.size()) {
+                for (const auto& [name, value] : command.pipeline_assignments[i]) {
+                    setenv(name.c_str(), value.c_str(), 1);
+                }
+            }
+
             // Execute the command
-            executeCommand(command.pipeline_commands[i]);
+            executeCommand(command.pipeline_commands[i],
+                           i < (int)command.pipeline_paths.size() ? command.pipeline_paths[i] : string());
             exit(1); // Should not reach here
-        } else if (pid < 0) {
+        }
+
+        // Parent process - the previous read end and this write end now belong to children
+        if (prev_read != -1) {
+            close(prev_read);
+        }
+        if (next[1] != -1) {
+            close(next[1]);
+        }
+        prev_read = next[0];
+
+        if (pid < 0) {
             cerr << "Error forking process " << i << endl;
-            // Clean up pipes and kill any already forked processes
-            for (int j = 0; j < n - 1; ++j) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
+            if (prev_read != -1) {
+                close(prev_read);
             }
             for (pid_t child_pid : pids) {
                 kill(child_pid, SIGTERM);
                 waitpid(child_pid, nullptr, 0);
             }
-            return;
-        } else {
-            pids.push_back(pid);
+            return 1;
         }
+        pids.push_back(pid);
     }
     
-    // Parent process - close all pipe file descriptors
-    for (int i = 0; i < n - 1; ++i) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
+    // Reap stages in whatever order they finish so each one's wall time is its
+    // own; the pipeline status is that of the last stage
+    int last = 0;
+    std::unordered_map<pid_t, size_t> stages;
+    for (size_t i = 0; i < pids.size(); ++i) {
+        stages[pids[i]] = i;
     }
-    
-    // Wait for all children to complete
-    for (pid_t pid : pids) {
+    while (!stages.empty()) {
         int status;
-        waitpid(pid, &status, 0);
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, 0, &usage);
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        auto stage = stages.find(pid);
+        if (stage == stages.end()) {
+            continue;
+        }
+        size_t i = stage->second;
+        stages.erase(stage);
+        if (i == pids.size() - 1) {
+            last = decodeWaitStatus(status);
+        }
+        bool is_body = i < command.pipeline_bodies.size() && command.pipeline_bodies[i];
+        journalProcess(is_body ? std::vector<std::string>{"(...)"} : command.pipeline_commands[i],
+                       start_times[i].first, monotonicNanos() - start_times[i].second, decodeWaitStatus(status), usage);
     }
+    return last;
 }
 
-void executeCommand(const std::vector<std::string>& args) {
-    if (args.empty()) {
-        return;
+bool isValidName(const std::string& name) {
+    if (name.empty() || !(std::isalpha(static_cast<unsigned char>(name[0])) || name[0] == '_')) {
+        return false;
     }
-    
-    string command_str = args[0];
-    
-    // Check if it's a builtin command
-    if (command_str == "echo") {
-        for (size_t i = 1; i < args.size(); ++i) {
-            cout << args[i];
-            if (i < args.size() - 1) {
-                cout << " ";
+    for (char c : name) {
+        if (!(std::isalnum(static_cast<unsigned char>(c)) || c == '_')) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Look up a shell variable, environment variable or special parameter
+std::string lookupVariable(const std::string& name) {
+    if (name == "?") {
+        return to_string(last_status);
+    }
+    if (name == "#") {
+        return to_string(positional_params.size());
+    }
+    if (name == "$") {
+        return to_string(getpid());
+    }
+    if (name == "@" || name == "*") {
+        string joined;
+        for (size_t i = 0; i < positional_params.size(); ++i) {
+            if (i > 0) {
+                joined += ' ';
             }
+            joined += positional_params[i];
         }
-        cout << endl;
-        exit(0);
-    } else if (command_str == "type") {
-        if (args.size() < 2) {
-            cout << "type: missing argument" << endl;
-            exit(1);
+        return joined;
+    }
+    if (!name.empty() && std::isdigit(static_cast<unsigned char>(name[0]))) {
+        size_t index = stoul(name);
+        if (index == 0) {
+            return "shell";
         }
-        string target = args[1];
-        if (target == "echo" || target == "exit" || target == "type" || target == "pwd" || target == "history") {
-            cout << target << " is a shell builtin" << endl;
+        return index <= positional_params.size() ? positional_params[index - 1] : "";
+    }
+    auto it = shell_variables.find(name);
+    if (it != shell_variables.end()) {
+        return it->second;
+    }
+    char* value = getenv(name.c_str());
+    return value != nullptr ? value : "";
+}
+
+// Assign a variable, updating the environment when it is already exported
+void setVariable(const std::string& name, const std::string& value) {
+    if (getenv(name.c_str()) != nullptr) {
+        setenv(name.c_str(), value.c_str(), 1);
+    } else {
+        shell_variables[name] = value;
+    }
+}
+
+// Expand a word into fields, splitting unquoted parameter values on whitespace
+void expandWord(const Word& word, std::vector<std::string>& fields) {
+    if (!word.has_params) {
+        fields.push_back(word.literal);
+        return;
+    }
+
+    string current;
+    bool have_field = false;
+    for (const WordPart& part : word.parts) {
+        if (!part.is_param) {
+            current += part.text;
+            have_field = have_field || part.quoted || !part.text.empty();
+        } else if (part.quoted && part.text == "@") {
+            // "$@" produces one field per positional parameter
+            for (size_t i = 0; i < positional_params.size(); ++i) {
+                if (i > 0) {
+                    fields.push_back(current);
+                    current.clear();
+                }
+                current += positional_params[i];
+                have_field = true;
+            }
+        } else if (part.quoted) {
+            current += lookupVariable(part.text);
+            have_field = true;
         } else {
-            bool found = false;
-            char* path = getenv("PATH");
-            if (path != nullptr) {
-                string pathStr(path);
-                istringstream pathStream(pathStr);
-                string dir;
-                while (getline(pathStream, dir, ':')) {
-                    string fullPath = dir + "/" + target;
-                    if (access(fullPath.c_str(), X_OK) == 0) {
-                        cout << target << " is " << fullPath << endl;
-                        found = true;
-                        break;
+            for (char c : lookupVariable(part.text)) {
+                if (std::isspace(static_cast<unsigned char>(c))) {
+                    if (have_field) {
+                        fields.push_back(current);
+                        current.clear();
+                        have_field = false;
                     }
+                } else {
+                    current += c;
+                    have_field = true;
                 }
             }
-            if (!found) {
-                cout << target << ": not found" << endl;
-            }
         }
-        exit(0);
-    } else if (command_str == "pwd") {
-        char cwd[1024];
-        if (getcwd(cwd, sizeof(cwd)) != nullptr) {
-            cout << cwd << endl;
-        } else {
-            cout << "pwd: error getting current directory" << endl;
-        }
-        exit(0);
-    } else if (command_str == "history") {
-        exit(0);
     }
-    
-    // Try to execute as external command
-    char* path = getenv("PATH");
-    if (path == nullptr) {
-        cerr << command_str << ": command not found" << endl;
-        exit(1);
+    if (have_field) {
+        fields.push_back(current);
     }
+}
 
-    string pathStr(path);
-    istringstream pathStream(pathStr);
-    string dir;
-    bool found = false;
+// Expand a word into a single string without field splitting
+std::string expandWordString(const Word& word) {
+    if (!word.has_params) {
+        return word.literal;
+    }
+    string result;
+    for (const WordPart& part : word.parts) {
+        result += part.is_param ? lookupVariable(part.text) : part.text;
+    }
+    return result;
+}
 
-    while (getline(pathStream, dir, ':')) {
-        string fullPath = dir + "/" + command_str;
-        if (access(fullPath.c_str(), X_OK) == 0) {
-            found = true;
-            
-            vector<char*> execArgs;
-            for (size_t i = 0; i < args.size(); ++i) {
-                execArgs.push_back(const_cast<char*>(args[i].c_str()));
+// Expand a case pattern, escaping glob characters that came from quoted text
+std::string expandPattern(const Word& word) {
+    string pattern;
+    for (const WordPart& part : word.parts) {
+        string text = part.is_param ? lookupVariable(part.text) : part.text;
+        if (!part.quoted) {
+            pattern += text;
+            continue;
+        }
+        for (char c : text) {
+            if (c == '*' || c == '?' || c == '[' || c == '\\') {
+                pattern += '\\';
             }
-            execArgs.push_back(nullptr);
-            
-            execv(fullPath.c_str(), execArgs.data());
-            cerr << "Error executing " << command_str << endl;
-            exit(1);
+            pattern += c;
         }
     }
+    return pattern;
+}
 
-    if (!found) {
-        cerr << command_str << ": command not found" << endl;
-        exit(1);
+// Syntax tree produced by the parser and consumed by the bytecode compiler
+enum class NodeKind { Simple, Pipeline, Sequence, And, Or, If, While, Until, For, Case, Group, Subshell, Function };
+
+struct Node {
+    NodeKind kind;
+    std::vector<Word> words;                      // Simple: command words, For: loop items, Case: subject
+    std::vector<Redirect> redirects;              // Redirections written after the command
+    std::vector<std::unique_ptr<Node>> children;  // And/Or: left and right, If: condition/body pairs then else
+    std::vector<std::vector<Word>> patterns;      // Case: patterns of each arm in children
+    std::string name;                             // For: loop variable, Function: function name
+    bool negated = false;                         // Pipeline preceded by '!'
+    bool has_in = false;                          // For loop with an explicit 'in' list
+};
+
+struct ParseError {
+    ParseStatus status;
+    std::string message;
+};
+
+// Aliases keep their value already tokenized, so expanding one splices
+// tokens into the command being parsed instead of lexing the text again
+struct Alias {
+    std::string value;
+    std::vector<Token> tokens;  // Without the End token
+};
+std::unordered_map<std::string, Alias> shell_aliases;
+
+// Recursive descent parser for lists, pipelines and compound commands
+struct Parser {
+    std::vector<Token>& tokens;
+    size_t pos = 0;
+
+    const Token& peek(size_t ahead = 0) const {
+        return tokens[std::min(pos + ahead, tokens.size() - 1)];
     }
-}
 
-int main() {
-    // Set up readline autocompletion
-    rl_attempted_completion_function = builtin_completion_generator;
-    
-    // Load history from HISTFILE environment variable if set
-    char* histfile = getenv("HISTFILE");
-    if (histfile != nullptr) {
-        read_history(histfile);
+    // Reserved words are only recognized when they are unquoted
+    bool atKeyword(const char* keyword, size_t ahead = 0) const {
+        const Token& tok = peek(ahead);
+        return tok.type == TokenType::Word && !tok.word.has_params && !tok.word.has_quotes && tok.word.literal == keyword;
     }
-    
-    while (true) {
-        char* input_line = readline("$ ");
-        
-        if (input_line == nullptr) {
-            // EOF or Ctrl+D
-            break;
+
+    bool atAnyKeyword(const std::vector<const char*>& keywords) const {
+        for (const char* keyword : keywords) {
+            if (atKeyword(keyword)) {
+                return true;
+            }
         }
-        
-        string input(input_line);
-        free(input_line); // Free the memory allocated by readline
-        
-        if (input.empty()) {
-            continue;
+        return false;
+    }
+
+    void skipNewlines() {
+        while (peek().type == TokenType::Newline) {
+            ++pos;
         }
-        
-        // Add to history if not empty
-        add_history(input.c_str());
-        
-        if (input == "exit 0") {
-            // Save history to HISTFILE before exiting
-            char* histfile = getenv("HISTFILE");
-            if (histfile != nullptr) {
-                write_history(histfile);
+    }
+
+    static std::string describe(const Token& tok) {
+        switch (tok.type) {
+            case TokenType::Word: {
+                string text;
+                for (const WordPart& part : tok.word.parts) {
+                    text += part.is_param ? "$" + part.text : part.text;
+                }
+                return text;
             }
-            exit(0);
+            case TokenType::Redirect:
+                switch (tok.redirect) {
+                    case RedirectOp::Out: return ">";
+                    case RedirectOp::Append: return ">>";
+                    case RedirectOp::In: return "<";
+                    case RedirectOp::DupOut: return ">&";
+                    case RedirectOp::DupIn: return "<&";
+                    case RedirectOp::OutErr: return "&>";
+                    case RedirectOp::AppendErr: return "&>>";
+                }
+                break;
+            case TokenType::Semi: return ";";
+            case TokenType::DoubleSemi: return ";;";
+            case TokenType::Newline: return "newline";
+            case TokenType::Pipe: return "|";
+            case TokenType::AndIf: return "&&";
+            case TokenType::OrIf: return "||";
+            case TokenType::LParen: return "(";
+            case TokenType::RParen: return ")";
+            case TokenType::End: break;
         }
+        return "newline";
+    }
 
-        ParsedCommand command = parseCommandWithRedirection(input);
+    // Running out of tokens means the user has not finished typing the command yet
+    [[noreturn]] void unexpected() const {
+        if (peek().type == TokenType::End) {
+            throw ParseError{ParseStatus::Incomplete, "syntax error: unexpected end of file"};
+        }
+        throw ParseError{ParseStatus::Error, "syntax error near unexpected token `" + describe(peek()) + "'"};
+    }
 
-        if (command.args.empty() && command.pipeline_commands.empty()) {
-            continue;
+    void expect(TokenType type) {
+        if (peek().type != type) {
+            unexpected();
         }
+        ++pos;
+    }
 
-        // Handle pipelines
-        if (command.is_pipeline) {
-            executePipeline(command);
-            continue;
+    void expectKeyword(const char* keyword) {
+        if (!atKeyword(keyword)) {
+            unexpected();
         }
+        ++pos;
+    }
+
+    static std::unique_ptr<Node> makeNode(NodeKind kind) {
+        auto node = std::make_unique<Node>();
+        node->kind = kind;
+        return node;
+    }
 
-        string command_str = command.args[0];
+    std::unique_ptr<Node> parseProgram() {
+        auto list = parseList({});
+        if (peek().type != TokenType::End) {
+            unexpected();
+        }
+        return list;
+    }
 
-        if (command_str == "echo") {
-            // Handle redirection for built-in commands
-            RedirectionState state = handleBuiltinRedirection(command);
-            // Check if there was an error during redirection setup
-            if ((command.has_redirection && state.original_stdout == -1) || 
-                (command.has_append_redirection && state.original_stdout == -1) ||
-                (command.has_stderr_redirection && state.original_stderr == -1) ||
-                (command.has_stderr_append_redirection && state.original_stderr == -1)) {
-                continue;
+    // And-or lists separated by ';' or newlines, up to one of the stop keywords
+    std::unique_ptr<Node> parseList(const std::vector<const char*>& stops) {
+        auto list = makeNode(NodeKind::Sequence);
+        while (true) {
+            skipNewlines();
+            TokenType type = peek().type;
+            if (type == TokenType::End || type == TokenType::RParen || type == TokenType::DoubleSemi || atAnyKeyword(stops)) {
+                break;
             }
-            
-            for (size_t i = 1; i < command.args.size(); ++i) {
-                cout << command.args[i];
-                if (i < command.args.size() - 1) {
-                    cout << " ";
-                }
-            }
-            cout << endl;
-            restoreRedirection(state);
-        } else if (command_str == "type") {
-            // Handle redirection for built-in commands
-            RedirectionState state = handleBuiltinRedirection(command);
-            // Check if there was an error during redirection setup
-            if ((command.has_redirection && state.original_stdout == -1) || 
-                (command.has_append_redirection && state.original_stdout == -1) ||
-                (command.has_stderr_redirection && state.original_stderr == -1) ||
-                (command.has_stderr_append_redirection && state.original_stderr == -1)) {
-                continue;
+            list->children.push_back(parseAndOr());
+            type = peek().type;
+            if (type != TokenType::Semi && type != TokenType::Newline) {
+                break;
             }
-            
-            if (command.args.size() < 2) {
-                cout << "type: missing argument" << endl;
-                restoreRedirection(state);
-                continue;
+            ++pos;
+        }
+        return list;
+    }
+
+    // Like parseList(), but at least one command is required
+    std::unique_ptr<Node> parseCompoundList(const std::vector<const char*>& stops) {
+        auto list = parseList(stops);
+        if (list->children.empty()) {
+            unexpected();
+        }
+        return list;
+    }
+
+    // Pipelines joined by && and ||, which bind left to right with equal precedence
+    std::unique_ptr<Node> parseAndOr() {
+        auto left = parsePipeline();
+        while (peek().type == TokenType::AndIf || peek().type == TokenType::OrIf) {
+            auto node = makeNode(peek().type == TokenType::AndIf ? NodeKind::And : NodeKind::Or);
+            ++pos;
+            skipNewlines();
+            node->children.push_back(std::move(left));
+            node->children.push_back(parsePipeline());
+            left = std::move(node);
+        }
+        return left;
+    }
+
+    std::unique_ptr<Node> parsePipeline() {
+        bool negated = false;
+        if (atKeyword("!")) {
+            negated = true;
+            ++pos;
+        }
+        auto first = parseCommand();
+        if (!negated && peek().type != TokenType::Pipe) {
+            return first;
+        }
+        auto pipeline = makeNode(NodeKind::Pipeline);
+        pipeline->negated = negated;
+        pipeline->children.push_back(std::move(first));
+        while (peek().type == TokenType::Pipe) {
+            ++pos;
+            skipNewlines();
+            pipeline->children.push_back(parseCommand());
+        }
+        return pipeline;
+    }
+
+    // Collect redirections, which may appear anywhere in a simple command
+    bool parseRedirect(Node& node) {
+        if (peek().type != TokenType::Redirect) {
+            return false;
+        }
+        const Token& op = tokens[pos++];
+        if (peek().type != TokenType::Word) {
+            unexpected();
+        }
+        node.redirects.push_back({op.fd, op.redirect, std::move(tokens[pos++].word)});
+        return true;
+    }
+
+    // Compound commands take their redirections after the closing keyword
+    std::unique_ptr<Node> withRedirects(std::unique_ptr<Node> node) {
+        while (parseRedirect(*node)) {
+        }
+        return node;
+    }
+
+    bool atCompoundCommand() const {
+        return peek().type == TokenType::LParen || atAnyKeyword({"if", "while", "until", "for", "case", "{"});
+    }
+
+    // Replace an unquoted alias name in command position by its tokens. The
+    // spliced tokens remember which aliases produced them, so an alias is not
+    // expanded again anywhere inside its own expansion. Returns whether
+    // anything was expanded.
+    bool expandAliases() {
+        bool expanded = false;
+        while (!shell_aliases.empty() && peek().type == TokenType::Word &&
+               !peek().word.has_params && !peek().word.has_quotes) {
+            auto it = shell_aliases.find(peek().word.literal);
+            if (it == shell_aliases.end()) {
+                break;
             }
-            string target = command.args[1];
-            if (target == "echo" || target == "exit" || target == "type" || target == "pwd" || target == "history") {
-                cout << target << " is a shell builtin" << endl;
-            } else {
-                bool found = false;
-                char* path = getenv("PATH");
-                if (path != nullptr) {
-                    string pathStr(path);
-                    istringstream pathStream(pathStr);
-                    string dir;
-                    while (getline(pathStream, dir, ':')) {
-                        string fullPath = dir + "/" + target;
-                        if (access(fullPath.c_str(), X_OK) == 0) {
-                            cout << target << " is " << fullPath << endl;
-                            found = true;
-                            break;
-                        }
-                    }
-                }
-                if (!found) {
-                    cout << target << ": not found" << endl;
-                }
-            }
-            restoreRedirection(state);
-        } else if (command_str == "pwd") {
-            // Handle redirection for built-in commands
-            RedirectionState state = handleBuiltinRedirection(command);
-            // Check if there was an error during redirection setup
-            if ((command.has_redirection && state.original_stdout == -1) || 
-                (command.has_append_redirection && state.original_stdout == -1) ||
-                (command.has_stderr_redirection && state.original_stderr == -1) ||
-                (command.has_stderr_append_redirection && state.original_stderr == -1)) {
-                continue;
+            std::shared_ptr<const AliasScope> scope = peek().alias_scope;
+            bool active = false;
+            for (const AliasScope* outer = scope.get(); outer != nullptr && !active; outer = outer->outer.get()) {
+                active = outer->name == it->first;
             }
-            
-            char cwd[1024];
-            if (getcwd(cwd, sizeof(cwd)) != nullptr) {
-                cout << cwd << endl;
-            } else {
-                cout << "pwd: error getting current directory" << endl;
-            }
-            restoreRedirection(state);
-        } else if (command_str == "history") {
-            // Handle redirection for built-in commands
-            RedirectionState state = handleBuiltinRedirection(command);
-            // Check if there was an error during redirection setup
-            if ((command.has_redirection && state.original_stdout == -1) || 
-                (command.has_append_redirection && state.original_stdout == -1) ||
-                (command.has_stderr_redirection && state.original_stderr == -1) ||
-                (command.has_stderr_append_redirection && state.original_stderr == -1)) {
-                continue;
+            if (active) {
+                break;
             }
-            
-            // Static variable to track last appended history index
-            static std::map<std::string, int> last_appended_index;
-            
-            // Check for history -a <file> command
-            if (command.args.size() > 2 && command.args[1] == "-a") {
-                string filename = command.args[2];
-                ofstream file(filename, ios::app);
-                if (file.is_open()) {
-                    HIST_ENTRY **the_list = history_list();
-                    int start = 0;
-                    if (last_appended_index.count(filename)) {
-                        start = last_appended_index[filename];
-                    }
-                    int total_entries = 0;
-                    while (the_list && the_list[total_entries]) {
-                        total_entries++;
-                    }
-                    for (int i = start; i < total_entries; ++i) {
-                        file << the_list[i]->line << endl;
-                    }
-                    file.close();
-                    last_appended_index[filename] = total_entries;
-                }
-                restoreRedirection(state);
-                continue;
+            auto inner = std::make_shared<const AliasScope>(AliasScope{it->first, scope});
+            const std::vector<Token>& replacement = it->second.tokens;
+            tokens.erase(tokens.begin() + pos);
+            tokens.insert(tokens.begin() + pos, replacement.begin(), replacement.end());
+            for (size_t i = 0; i < replacement.size(); ++i) {
+                tokens[pos + i].alias_scope = inner;
             }
-            
-            // Check for history -r <file> command
-            if (command.args.size() > 2 && command.args[1] == "-r") {
-                string filename = command.args[2];
-                ifstream file(filename);
-                if (file.is_open()) {
-                    string line;
-                    while (getline(file, line)) {
-                        // Skip empty lines
-                        if (!line.empty()) {
-                            add_history(line.c_str());
-                        }
-                    }
-                    file.close();
-                }
-                restoreRedirection(state);
-                continue;
+            expanded = true;
+        }
+        return expanded;
+    }
+
+    bool atCommandEnd() const {
+        switch (peek().type) {
+            case TokenType::Semi:
+            case TokenType::DoubleSemi:
+            case TokenType::Newline:
+            case TokenType::Pipe:
+            case TokenType::AndIf:
+            case TokenType::OrIf:
+            case TokenType::RParen:
+            case TokenType::End:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    std::unique_ptr<Node> parseCommand() {
+        // An alias with an empty value leaves an empty command, which does nothing
+        if (expandAliases() && atCommandEnd()) {
+            return makeNode(NodeKind::Simple);
+        }
+        if (peek().type == TokenType::LParen) {
+            ++pos;
+            auto node = makeNode(NodeKind::Subshell);
+            node->children.push_back(parseCompoundList({}));
+            expect(TokenType::RParen);
+            return withRedirects(std::move(node));
+        }
+        if (peek().type != TokenType::Word && peek().type != TokenType::Redirect) {
+            unexpected();
+        }
+        if (atKeyword("if")) {
+            return withRedirects(parseIf());
+        }
+        if (atKeyword("while") || atKeyword("until")) {
+            return withRedirects(parseLoop(atKeyword("while") ? NodeKind::While : NodeKind::Until));
+        }
+        if (atKeyword("for")) {
+            return withRedirects(parseFor());
+        }
+        if (atKeyword("case")) {
+            return withRedirects(parseCase());
+        }
+        if (atKeyword("{")) {
+            ++pos;
+            auto node = makeNode(NodeKind::Group);
+            node->children.push_back(parseCompoundList({"}"}));
+            expectKeyword("}");
+            return withRedirects(std::move(node));
+        }
+        if (atKeyword("function")) {
+            ++pos;
+            string name = parseName();
+            if (peek().type == TokenType::LParen) {
+                ++pos;
+                expect(TokenType::RParen);
             }
-            
-            // Check for history -w <file> command
-            if (command.args.size() > 2 && command.args[1] == "-w") {
-                string filename = command.args[2];
-                ofstream file(filename);
-                if (file.is_open()) {
-                    HIST_ENTRY **the_list = history_list();
-                    if (the_list) {
-                        for (int i = 0; the_list[i]; ++i) {
-                            file << the_list[i]->line << endl;
-                        }
-                    }
-                    file.close();
-                }
-                restoreRedirection(state);
-                continue;
+            return parseFunctionBody(name);
+        }
+        if (peek(1).type == TokenType::LParen && peek(2).type == TokenType::RParen) {
+            string name = parseName();
+            pos += 2;
+            return parseFunctionBody(name);
+        }
+        if (atAnyKeyword({"then", "else", "elif", "fi", "do", "done", "esac", "}"})) {
+            unexpected();
+        }
+
+        auto node = makeNode(NodeKind::Simple);
+        while (true) {
+            if (peek().type == TokenType::Word) {
+                node->words.push_back(std::move(tokens[pos++].word));
+            } else if (!parseRedirect(*node)) {
+                break;
             }
-            
-            HIST_ENTRY **the_list = history_list();
-            if (the_list) {
-                int total_entries = 0;
-                while (the_list[total_entries]) {
-                    total_entries++;
-                }
-                
-                // Check if a number argument is provided
-                int limit = total_entries; // Default to showing all entries
-                if (command.args.size() > 1) {
-                    try {
-                        limit = stoi(command.args[1]);
-                        if (limit < 0) {
-                            limit = total_entries; // If negative, show all
-                        }
-                    } catch (const std::exception&) {
-                        limit = total_entries; // If invalid number, show all
+        }
+        return node;
+    }
+
+    std::string parseName() {
+        const Token& tok = peek();
+        if (tok.type != TokenType::Word || tok.word.has_params || tok.word.has_quotes || !isValidName(tok.word.literal)) {
+            unexpected();
+        }
+        ++pos;
+        return tok.word.literal;
+    }
+
+    std::unique_ptr<Node> parseFunctionBody(const std::string& name) {
+        skipNewlines();
+        if (!atCompoundCommand()) {
+            unexpected();
+        }
+        auto node = makeNode(NodeKind::Function);
+        node->name = name;
+        node->children.push_back(parseCommand());
+        return node;
+    }
+
+    std::unique_ptr<Node> parseIf() {
+        auto node = makeNode(NodeKind::If);
+        ++pos;
+        node->children.push_back(parseCompoundList({"then"}));
+        expectKeyword("then");
+        node->children.push_back(parseCompoundList({"elif", "else", "fi"}));
+        while (atKeyword("elif")) {
+            ++pos;
+            node->children.push_back(parseCompoundList({"then"}));
+            expectKeyword("then");
+            node->children.push_back(parseCompoundList({"elif", "else", "fi"}));
+        }
+        if (atKeyword("else")) {
+            ++pos;
+            node->children.push_back(parseCompoundList({"fi"}));
+        }
+        expectKeyword("fi");
+        return node;
+    }
+
+    std::unique_ptr<Node> parseLoop(NodeKind kind) {
+        auto node = makeNode(kind);
+        ++pos;
+        node->children.push_back(parseCompoundList({"do"}));
+        expectKeyword("do");
+        node->children.push_back(parseCompoundList({"done"}));
+        expectKeyword("done");
+        return node;
+    }
+
+    std::unique_ptr<Node> parseFor() {
+        auto node = makeNode(NodeKind::For);
+        ++pos;
+        node->name = parseName();
+        skipNewlines();
+        if (atKeyword("in")) {
+            ++pos;
+            node->has_in = true;
+            while (peek().type == TokenType::Word) {
+                node->words.push_back(std::move(tokens[pos++].word));
+            }
+            if (peek().type != TokenType::Semi && peek().type != TokenType::Newline) {
+                unexpected();
+            }
+            ++pos;
+        } else if (peek().type == TokenType::Semi) {
+            ++pos;
+        }
+        skipNewlines();
+        expectKeyword("do");
+        node->children.push_back(parseCompoundList({"done"}));
+        expectKeyword("done");
+        return node;
+    }
+
+    std::unique_ptr<Node> parseCase() {
+        auto node = makeNode(NodeKind::Case);
+        ++pos;
+        if (peek().type != TokenType::Word) {
+            unexpected();
+        }
+        node->words.push_back(std::move(tokens[pos++].word));
+        skipNewlines();
+        expectKeyword("in");
+        while (true) {
+            skipNewlines();
+            if (atKeyword("esac")) {
+                ++pos;
+                break;
+            }
+            if (peek().type == TokenType::LParen) {
+                ++pos;
+            }
+            std::vector<Word> patterns;
+            while (true) {
+                if (peek().type != TokenType::Word) {
+                    unexpected();
+                }
+                patterns.push_back(std::move(tokens[pos++].word));
+                if (peek().type != TokenType::Pipe) {
+                    break;
+                }
+                ++pos;
+            }
+            expect(TokenType::RParen);
+            node->patterns.push_back(std::move(patterns));
+            node->children.push_back(parseList({"esac"}));
+            if (peek().type == TokenType::DoubleSemi) {
+                ++pos;
+            } else if (!atKeyword("esac")) {
+                unexpected();
+            }
+        }
+        return node;
+    }
+};
+
+std::vector<Redirection> expandRedirects(const std::vector<Redirect>& redirects) {
+    std::vector<Redirection> result;
+    result.reserve(redirects.size());
+    for (const Redirect& redirect : redirects) {
+        result.push_back({redirect.fd, redirect.op, expandWordString(redirect.target)});
+    }
+    return result;
+}
+
+// Per call site cache of how the command name was last resolved
+struct CallSite {
+    std::string name;
+    Builtin builtin = Builtin::None;
+    std::string path_env;  // PATH the external command was resolved against
+    std::string resolved;  // Full path of the external command, empty if not found
+};
+
+struct SimpleCommand {
+    std::vector<Word> words;
+    std::vector<Redirect> redirects;
+    size_t assign_count = 0;  // Leading NAME=value words
+    CallSite site;
+};
+
+// Compound pipeline stages carry a compiled body instead of a simple command
+struct PipelineStage {
+    uint32_t command;
+    std::shared_ptr<Program> body;
+};
+
+struct ForLoop {
+    std::string var;
+    std::vector<Word> items;
+    bool has_in;
+};
+
+enum class OpCode : uint8_t {
+    Run,            // a: command index
+    Pipeline,       // a: pipeline index
+    Subshell,       // a: body index
+    Jump,           // a: target
+    JumpIfFail,     // a: target, taken when the status is non-zero
+    JumpIfOk,       // a: target, taken when the status is zero
+    Negate,
+    SetStatus,      // a: status
+    SaveStatus,     // a: loop slot
+    RestoreStatus,  // a: loop slot
+    ForInit,        // a: for loop index, b: loop slot
+    ForNext,        // a: target when exhausted, b: loop slot
+    CaseSubject,    // a: subject index
+    CaseMatch,      // a: target when no pattern matches, b: pattern list index
+    Define,         // a: body index, b: name index
+    PushRedirects,  // a: target when a file cannot be opened, b: redirect list index
+    PopRedirects,
+    Return,         // a: command index holding the return value
+};
+
+struct Instr {
+    OpCode op;
+    uint32_t a;
+    uint32_t b;
+};
+
+// A compiled instruction stream together with the operands it refers to
+struct Program {
+    std::vector<Instr> code;
+    std::vector<SimpleCommand> commands;
+    std::vector<std::vector<PipelineStage>> pipelines;
+    std::vector<ForLoop> for_loops;
+    std::vector<Word> case_subjects;
+    std::vector<std::vector<Word>> case_patterns;
+    std::vector<std::shared_ptr<Program>> bodies;  // Functions, subshells and compound pipeline stages
+    std::vector<std::string> names;
+    std::vector<std::vector<Redirect>> redirect_lists;  // Redirections of compound commands
+    uint32_t loop_slots = 0;
+};
+
+bool isAssignment(const Word& word) {
+    if (word.parts.empty() || word.parts[0].is_param || word.parts[0].quoted) {
+        return false;
+    }
+    size_t eq = word.parts[0].text.find('=');
+    return eq != std::string::npos && isValidName(word.parts[0].text.substr(0, eq));
+}
+
+// Translates a syntax tree into a flat instruction stream
+struct Compiler {
+    Program& program;
+    bool in_function;
+
+    struct Loop {
+        std::vector<uint32_t> breaks;
+        std::vector<uint32_t> continues;
+        uint32_t redirect_depth;
+    };
+    std::vector<Loop> loops;
+    uint32_t redirect_depth = 0;  // Compound redirections active at this point
+
+    uint32_t here() const {
+        return program.code.size();
+    }
+
+    uint32_t emit(OpCode op, uint32_t a = 0, uint32_t b = 0) {
+        program.code.push_back({op, a, b});
+        return here() - 1;
+    }
+
+    // Point a previously emitted jump at the current position
+    void patch(uint32_t at) {
+        program.code[at].a = here();
+    }
+
+    uint32_t openLoop() {
+        loops.push_back({{}, {}, redirect_depth});
+        program.loop_slots = std::max<uint32_t>(program.loop_slots, loops.size());
+        return loops.size() - 1;
+    }
+
+    void patchContinues() {
+        for (uint32_t at : loops.back().continues) {
+            patch(at);
+        }
+    }
+
+    void closeLoop() {
+        for (uint32_t at : loops.back().breaks) {
+            patch(at);
+        }
+        loops.pop_back();
+    }
+
+    std::shared_ptr<Program> compileBody(Node& node, bool function_body) {
+        auto body = std::make_shared<Program>();
+        Compiler compiler{*body, function_body};
+        compiler.compile(node);
+        return body;
+    }
+
+    static void countNodes(const Node& node, size_t& commands, size_t& nodes) {
+        ++nodes;
+        if (node.kind == NodeKind::Simple) {
+            ++commands;
+        }
+        for (const auto& child : node.children) {
+            countNodes(*child, commands, nodes);
+        }
+    }
+
+    // Size the tables for a whole input up front, so a line holding hundreds
+    // of commands grows each of them once instead of reallocating as it goes
+    void reserve(const Node& tree) {
+        size_t commands = 0;
+        size_t nodes = 0;
+        countNodes(tree, commands, nodes);
+        program.commands.reserve(commands);
+        program.code.reserve(nodes * 2);
+    }
+
+    uint32_t addCommand(Node& node) {
+        SimpleCommand command;
+        command.words = std::move(node.words);
+        command.redirects = std::move(node.redirects);
+        while (command.assign_count < command.words.size() && isAssignment(command.words[command.assign_count])) {
+            ++command.assign_count;
+        }
+        program.commands.push_back(std::move(command));
+        return program.commands.size() - 1;
+    }
+
+    void compileSimple(Node& node) {
+        if (node.words.empty()) {
+            emit(OpCode::Run, addCommand(node));
+            return;
+        }
+        const Word& first = node.words[0];
+        bool literal = !first.has_params && !first.has_quotes;
+
+        // break and continue inside a loop become plain jumps
+        if (literal && (first.literal == "break" || first.literal == "continue") && !loops.empty()) {
+            size_t levels = 1;
+            if (node.words.size() > 1 && !node.words[1].has_params) {
+                levels = std::max(1ul, strtoul(node.words[1].literal.c_str(), nullptr, 10));
+            }
+            Loop& loop = loops[loops.size() - std::min(levels, loops.size())];
+            // Leaving redirected compound commands inside the loop undoes their redirections
+            for (uint32_t depth = redirect_depth; depth > loop.redirect_depth; --depth) {
+                emit(OpCode::PopRedirects);
+            }
+            emit(OpCode::SetStatus, 0);
+            (first.literal == "break" ? loop.breaks : loop.continues).push_back(emit(OpCode::Jump));
+            return;
+        }
+        if (literal && first.literal == "return" && in_function) {
+            emit(OpCode::Return, addCommand(node));
+            return;
+        }
+        emit(OpCode::Run, addCommand(node));
+    }
+
+    void compile(Node& node) {
+        if (node.kind == NodeKind::Simple || node.redirects.empty()) {
+            compileNode(node);
+            return;
+        }
+        program.redirect_lists.push_back(std::move(node.redirects));
+        uint32_t push = emit(OpCode::PushRedirects, 0, program.redirect_lists.size() - 1);
+        ++redirect_depth;
+        compileNode(node);
+        --redirect_depth;
+        emit(OpCode::PopRedirects);
+        patch(push);
+    }
+
+    void compileNode(Node& node) {
+        switch (node.kind) {
+            case NodeKind::Simple:
+                compileSimple(node);
+                break;
+
+            case NodeKind::Sequence:
+            case NodeKind::Group:
+                for (auto& child : node.children) {
+                    compile(*child);
+                }
+                break;
+
+            case NodeKind::And:
+            case NodeKind::Or: {
+                // The right side only runs when the left side's status allows it
+                compile(*node.children[0]);
+                uint32_t skip = emit(node.kind == NodeKind::And ? OpCode::JumpIfFail : OpCode::JumpIfOk);
+                compile(*node.children[1]);
+                patch(skip);
+                break;
+            }
+
+            case NodeKind::Pipeline: {
+                if (node.children.size() == 1) {
+                    compile(*node.children[0]);
+                } else {
+                    std::vector<PipelineStage> stages;
+                    for (auto& child : node.children) {
+                        if (child->kind == NodeKind::Simple) {
+                            stages.push_back({addCommand(*child), nullptr});
+                        } else {
+                            stages.push_back({0, compileBody(*child, false)});
+                        }
+                    }
+                    program.pipelines.push_back(std::move(stages));
+                    emit(OpCode::Pipeline, program.pipelines.size() - 1);
+                }
+                if (node.negated) {
+                    emit(OpCode::Negate);
+                }
+                break;
+            }
+
+            case NodeKind::Subshell:
+                program.bodies.push_back(compileBody(*node.children[0], false));
+                emit(OpCode::Subshell, program.bodies.size() - 1);
+                break;
+
+            case NodeKind::If: {
+                std::vector<uint32_t> ends;
+                size_t i = 0;
+                for (; i + 1 < node.children.size(); i += 2) {
+                    compile(*node.children[i]);
+                    uint32_t next = emit(OpCode::JumpIfFail);
+                    compile(*node.children[i + 1]);
+                    ends.push_back(emit(OpCode::Jump));
+                    patch(next);
+                }
+                if (i < node.children.size()) {
+                    compile(*node.children[i]);
+                } else {
+                    emit(OpCode::SetStatus, 0);
+                }
+                for (uint32_t at : ends) {
+                    patch(at);
+                }
+                break;
+            }
+
+            case NodeKind::While:
+            case NodeKind::Until: {
+                // The loop status is that of the last body command, or 0 if the body never ran
+                uint32_t slot = openLoop();
+                emit(OpCode::SetStatus, 0);
+                emit(OpCode::SaveStatus, slot);
+                uint32_t head = here();
+                compile(*node.children[0]);
+                uint32_t exit = emit(node.kind == NodeKind::While ? OpCode::JumpIfFail : OpCode::JumpIfOk);
+                compile(*node.children[1]);
+                patchContinues();
+                emit(OpCode::SaveStatus, slot);
+                emit(OpCode::Jump, head);
+                patch(exit);
+                emit(OpCode::RestoreStatus, slot);
+                closeLoop();
+                break;
+            }
+
+            case NodeKind::For: {
+                uint32_t slot = openLoop();
+                program.for_loops.push_back({node.name, std::move(node.words), node.has_in});
+                emit(OpCode::ForInit, program.for_loops.size() - 1, slot);
+                uint32_t next = emit(OpCode::ForNext, 0, slot);
+                compile(*node.children[0]);
+                patchContinues();
+                emit(OpCode::Jump, next);
+                patch(next);
+                closeLoop();
+                break;
+            }
+
+            case NodeKind::Case: {
+                program.case_subjects.push_back(std::move(node.words[0]));
+                emit(OpCode::CaseSubject, program.case_subjects.size() - 1);
+                std::vector<uint32_t> ends;
+                for (size_t i = 0; i < node.children.size(); ++i) {
+                    program.case_patterns.push_back(std::move(node.patterns[i]));
+                    uint32_t next = emit(OpCode::CaseMatch, 0, program.case_patterns.size() - 1);
+                    compile(*node.children[i]);
+                    ends.push_back(emit(OpCode::Jump));
+                    patch(next);
+                }
+                for (uint32_t at : ends) {
+                    patch(at);
+                }
+                break;
+            }
+
+            case NodeKind::Function:
+                program.bodies.push_back(compileBody(*node.children[0], true));
+                program.names.push_back(node.name);
+                emit(OpCode::Define, program.bodies.size() - 1, program.names.size() - 1);
+                break;
+        }
+    }
+};
+
+// Search PATH for an executable, returning an empty string when it is not found
+std::string resolveCommand(const std::string& command_str) {
+    PathHash& hash = currentPathHash();
+    auto hashed = hash.commands.find(command_str);
+    if (hashed != hash.commands.end()) {
+        shell_stats.path_hash_hits++;
+        return hashed->second;
+    }
+    if (getenv("PATH") == nullptr) {
+        return "";
+    }
+
+    // Misses are probed again so newly installed commands are picked up
+    istringstream pathStream(hash.path_env);
+    string dir;
+    while (getline(pathStream, dir, ':')) {
+        string fullPath = dir + "/" + command_str;
+        if (access(fullPath.c_str(), X_OK) == 0) {
+            hash.commands.emplace(command_str, fullPath);
+            return fullPath;
+        }
+        shell_stats.failed_probes++;
+    }
+    return "";
+}
+
+// Launch an external command with posix_spawn(), the redirections becoming file actions
+int runExternal(const ParsedCommand& command, const std::string& fullPath) {
+    FdPlan plan;
+    if (!openFdPlan(command.redirections, plan)) {
+        return 1;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    addSpawnActions(plan, &actions);
+
+    vector<char*> execArgs;
+    for (size_t i = 0; i < command.args.size(); ++i) {
+        execArgs.push_back(const_cast<char*>(command.args[i].c_str()));
+    }
+    execArgs.push_back(nullptr);
+
+    cout.flush();
+    // posix_spawn() returns once the child has exec'd, which gives launch-to-exec latency
+    shell_stats.forks++;
+    uint64_t started = monotonicNanos();
+    uint64_t start_time = realtimeNanos();
+    pid_t pid;
+    int err = posix_spawn(&pid, fullPath.c_str(), &actions, nullptr, execArgs.data(), environ);
+    shell_stats.launch_to_exec.record(monotonicNanos() - started);
+    posix_spawn_file_actions_destroy(&actions);
+    closeFdPlan(plan);
+    if (err != 0) {
+        cerr << "Error executing " << command.args[0] << endl;
+        return 126;
+    }
+
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    journalProcess(command.args, start_time, monotonicNanos() - started, decodeWaitStatus(status), usage);
+    return decodeWaitStatus(status);
+}
+
+int runParsedCommand(const ParsedCommand& command, CallSite& site);
+
+// Output stream over a bare file descriptor
+struct FdStreamBuf : std::streambuf {
+    int fd;
+    char buffer[4096];
+
+    explicit FdStreamBuf(int fd) : fd(fd) {
+        setp(buffer, buffer + sizeof(buffer));
+    }
+
+    ~FdStreamBuf() override {
+        sync();
+    }
+
+    int overflow(int c) override {
+        if (sync() == -1) {
+            return traits_type::eof();
+        }
+        if (c != traits_type::eof()) {
+            *pptr() = static_cast<char>(c);
+            pbump(1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+    int sync() override {
+        for (char* p = pbase(); p < pptr();) {
+            ssize_t n = write(fd, p, pptr() - p);
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                setp(buffer, buffer + sizeof(buffer));
+                return -1;
+            }
+            p += n;
+        }
+        setp(buffer, buffer + sizeof(buffer));
+        return 0;
+    }
+};
+
+// Where a builtin writes: the shell's stdout, or directly the file a stdout
+// redirection opened so the shell's own stdout never has to be moved
+struct BuiltinOutput {
+    int fd;
+    std::ostream& stream;
+};
+
+// Output cache used by the cache builtin. Entries are keyed by a hash of the
+// command line, working directory, selected environment and input files, and
+// point at stdout/stderr blobs stored under the hash of their content.
+struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+CacheStats cache_stats;
+
+const uint64_t DEFAULT_CACHE_LIMIT = 64ull << 20;
+
+// 128-bit hash built from two FNV-1a style lanes with different parameters
+struct Hash128 {
+    uint64_t a = 0xcbf29ce484222325ull;
+    uint64_t b = 0x6c62272e07bb0142ull;
+
+    void update(const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            a = (a ^ bytes[i]) * 0x100000001b3ull;
+            b = (b ^ bytes[i]) * 0x9e3779b97f4a7c15ull;
+        }
+    }
+
+    // Length-prefixed so that field boundaries are part of the hash
+    void field(const std::string& text) {
+        uint64_t size = text.size();
+        update(&size, sizeof(size));
+        update(text.data(), text.size());
+    }
+
+    std::string hex() const {
+        char buf[33];
+        snprintf(buf, sizeof(buf), "%016llx%016llx", (unsigned long long)a, (unsigned long long)b);
+        return buf;
+    }
+};
+
+std::string cacheDirectory() {
+    if (char* dir = getenv("SHELL_CACHE_DIR")) {
+        return dir;
+    }
+    if (char* xdg = getenv("XDG_CACHE_HOME")) {
+        return string(xdg) + "/shell";
+    }
+    if (char* home = getenv("HOME")) {
+        return string(home) + "/.cache/shell";
+    }
+    return "/tmp/shell-cache-" + to_string(getuid());
+}
+
+uint64_t cacheLimit() {
+    char* limit = getenv("SHELL_CACHE_SIZE");
+    if (limit == nullptr) {
+        return DEFAULT_CACHE_LIMIT;
+    }
+    return strtoull(limit, nullptr, 10);
+}
+
+// Create a directory and any missing parents
+bool makeDirectories(const std::string& path) {
+    for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1)) {
+        string prefix = path.substr(0, slash);
+        if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+        if (slash == string::npos) {
+            return true;
+        }
+    }
+}
+
+// Hash a file's contents, returning false if it cannot be read
+bool hashFile(const std::string& path, Hash128& hash) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        hash.update(buf, n);
+    }
+    close(fd);
+    return n == 0;
+}
+
+// Copy a stored blob to a descriptor
+void replayBlob(const std::string& path, int out_fd) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        for (ssize_t written = 0; written < n; ) {
+            ssize_t w = write(out_fd, buf + written, n - written);
+            if (w <= 0) {
+                close(fd);
+                return;
+            }
+            written += w;
+        }
+    }
+    close(fd);
+}
+
+// Move a captured output file into the blob store, returning its content hash
+std::string storeBlob(const std::string& dir, const std::string& captured) {
+    Hash128 hash;
+    hashFile(captured, hash);
+    string name = hash.hex();
+    string blob = dir + "/blobs/" + name;
+    if (access(blob.c_str(), F_OK) == 0) {
+        unlink(captured.c_str());
+    } else {
+        rename(captured.c_str(), blob.c_str());
+    }
+    return name;
+}
+
+struct CacheEntry {
+    int status = 0;
+    std::string stdout_blob;
+    std::string stderr_blob;
+};
+
+bool readCacheEntry(const std::string& path, CacheEntry& entry) {
+    ifstream file(path);
+    string label;
+    return static_cast<bool>(file >> label >> entry.status >> label >> entry.stdout_blob >> label >> entry.stderr_blob);
+}
+
+// Evict the least recently used entries, and blobs nothing refers to, until under the limit
+void enforceCacheLimit(const std::string& dir, uint64_t limit) {
+    struct EntryInfo {
+        std::string path;
+        struct timespec used;
+        uint64_t size;
+        CacheEntry entry;
+    };
+    std::vector<EntryInfo> entries;
+    std::unordered_map<std::string, int> references;
+
+    if (DIR* dirp = opendir((dir + "/entries").c_str())) {
+        while (struct dirent* ent = readdir(dirp)) {
+            if (ent->d_name[0] == '.') {
+                continue;
+            }
+            EntryInfo info;
+            info.path = dir + "/entries/" + ent->d_name;
+            struct stat st;
+            if (stat(info.path.c_str(), &st) != 0 || !readCacheEntry(info.path, info.entry)) {
+                continue;
+            }
+            info.used = st.st_mtim;
+            info.size = st.st_size;
+            references[info.entry.stdout_blob]++;
+            references[info.entry.stderr_blob]++;
+            entries.push_back(std::move(info));
+        }
+        closedir(dirp);
+    }
+
+    // Entry files count too, or entries whose output is empty could never be evicted
+    uint64_t total = 0;
+    for (const EntryInfo& info : entries) {
+        total += info.size;
+    }
+    std::unordered_map<std::string, uint64_t> blob_sizes;
+    if (DIR* dirp = opendir((dir + "/blobs").c_str())) {
+        while (struct dirent* ent = readdir(dirp)) {
+            if (ent->d_name[0] == '.') {
+                continue;
+            }
+            string path = dir + "/blobs/" + ent->d_name;
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0) {
+                continue;
+            }
+            if (!references.count(ent->d_name)) {
+                unlink(path.c_str());
+                continue;
+            }
+            blob_sizes[ent->d_name] = st.st_size;
+            total += st.st_size;
+        }
+        closedir(dirp);
+    }
+
+    if (total <= limit) {
+        return;
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const EntryInfo& x, const EntryInfo& y) {
+        return x.used.tv_sec != y.used.tv_sec ? x.used.tv_sec < y.used.tv_sec : x.used.tv_nsec < y.used.tv_nsec;
+    });
+    for (const EntryInfo& info : entries) {
+        if (total <= limit) {
+            break;
+        }
+        unlink(info.path.c_str());
+        total -= info.size;
+        for (const string& blob : {info.entry.stdout_blob, info.entry.stderr_blob}) {
+            if (--references[blob] == 0 && blob_sizes.count(blob)) {
+                unlink((dir + "/blobs/" + blob).c_str());
+                total -= blob_sizes[blob];
+                blob_sizes.erase(blob);
+            }
+        }
+    }
+}
+
+// Remove every entry and blob, whatever the size of the stored output
+void clearCache(const std::string& dir) {
+    for (const char* sub : {"/entries/", "/blobs/"}) {
+        string path = dir + sub;
+        if (DIR* dirp = opendir(path.c_str())) {
+            while (struct dirent* ent = readdir(dirp)) {
+                if (ent->d_name[0] != '.') {
+                    unlink((path + ent->d_name).c_str());
+                }
+            }
+            closedir(dirp);
+        }
+    }
+}
+
+void printCacheStats(const std::string& dir, std::ostream& out) {
+    size_t entries = 0;
+    uint64_t bytes = 0;
+    if (DIR* dirp = opendir((dir + "/entries").c_str())) {
+        while (struct dirent* ent = readdir(dirp)) {
+            struct stat st;
+            if (ent->d_name[0] != '.' && stat((dir + "/entries/" + ent->d_name).c_str(), &st) == 0) {
+                entries++;
+                bytes += st.st_size;
+            }
+        }
+        closedir(dirp);
+    }
+    if (DIR* dirp = opendir((dir + "/blobs").c_str())) {
+        while (struct dirent* ent = readdir(dirp)) {
+            struct stat st;
+            if (ent->d_name[0] != '.' && stat((dir + "/blobs/" + ent->d_name).c_str(), &st) == 0) {
+                bytes += st.st_size;
+            }
+        }
+        closedir(dirp);
+    }
+    out << "cache: " << dir << endl;
+    out << "cache: " << entries << " entries, " << bytes << " of " << cacheLimit() << " bytes" << endl;
+    out << "cache: " << cache_stats.hits << " hits, " << cache_stats.misses << " misses this session" << endl;
+}
+
+// cache [--inputs files... --] [--env NAME]... [--content] command [args...]
+// cache --stats | --clear
+int runCache(const std::vector<std::string>& args, BuiltinOutput& out) {
+    string dir = cacheDirectory();
+    std::vector<std::string> inputs;
+    std::vector<std::string> env_names = {"PATH"};
+    bool hash_content = false;
+
+    size_t i = 1;
+    for (; i < args.size() && args[i].rfind("--", 0) == 0; ++i) {
+        if (args[i] == "--") {
+            ++i;
+            break;
+        } else if (args[i] == "--stats") {
+            printCacheStats(dir, out.stream);
+            return 0;
+        } else if (args[i] == "--clear") {
+            clearCache(dir);
+            return 0;
+        } else if (args[i] == "--inputs") {
+            while (i + 1 < args.size() && args[i + 1] != "--") {
+                inputs.push_back(args[++i]);
+            }
+            ++i;
+        } else if (args[i] == "--env" && i + 1 < args.size()) {
+            env_names.push_back(args[++i]);
+        } else if (args[i] == "--content") {
+            hash_content = true;
+        } else {
+            cerr << "cache: " << args[i] << ": invalid option" << endl;
+            return 2;
+        }
+    }
+    if (i >= args.size()) {
+        cerr << "cache: usage: cache [--inputs files... --] [--env NAME]... [--content] command [args...]" << endl;
+        return 2;
+    }
+
+    ParsedCommand inner;
+    inner.args.assign(args.begin() + i, args.end());
+
+    // The key covers everything the command's output is assumed to depend on
+    Hash128 key;
+    key.field("v1");
+    char cwd[4096];
+    key.field(getcwd(cwd, sizeof(cwd)) != nullptr ? cwd : "");
+    for (const string& arg : inner.args) {
+        key.field(arg);
+    }
+    for (const string& name : env_names) {
+        char* value = getenv(name.c_str());
+        key.field(name);
+        key.field(value != nullptr ? string("=") + value : string("unset"));
+    }
+    for (const string& input : inputs) {
+        key.field(input);
+        struct stat st;
+        if (stat(input.c_str(), &st) != 0) {
+            key.field("missing");
+        } else if (hash_content) {
+            Hash128 content;
+            hashFile(input, content);
+            key.field(content.hex());
+        } else {
+            key.field(to_string(st.st_size) + ":" + to_string(st.st_mtim.tv_sec) + "." + to_string(st.st_mtim.tv_nsec));
+        }
+    }
+
+    string entry_path = dir + "/entries/" + key.hex();
+    CacheEntry entry;
+    if (readCacheEntry(entry_path, entry) &&
+        access((dir + "/blobs/" + entry.stdout_blob).c_str(), R_OK) == 0 &&
+        access((dir + "/blobs/" + entry.stderr_blob).c_str(), R_OK) == 0) {
+        cache_stats.hits++;
+        // Touching the entry records its use for LRU eviction
+        utimensat(AT_FDCWD, entry_path.c_str(), nullptr, 0);
+        out.stream.flush();
+        replayBlob(dir + "/blobs/" + entry.stdout_blob, out.fd);
+        replayBlob(dir + "/blobs/" + entry.stderr_blob, STDERR_FILENO);
+        return entry.status;
+    }
+    cache_stats.misses++;
+
+    // Run the command with its output captured, through the normal launch path
+    string out_path = dir + "/capture.XXXXXX";
+    string err_path = dir + "/capture.XXXXXX";
+    int out_fd = -1;
+    int err_fd = -1;
+    if (makeDirectories(dir + "/entries") && makeDirectories(dir + "/blobs")) {
+        out_fd = mkostemp(out_path.data(), O_CLOEXEC);
+        err_fd = mkostemp(err_path.data(), O_CLOEXEC);
+    }
+    if (out_fd == -1 || err_fd == -1) {
+        cerr << "cache: cannot write to " << dir << ", running uncached" << endl;
+        if (out_fd != -1) {
+            close(out_fd);
+            unlink(out_path.c_str());
+        }
+        if (err_fd != -1) {
+            close(err_fd);
+            unlink(err_path.c_str());
+        }
+        if (out.fd != STDOUT_FILENO) {
+            inner.redirections.push_back({STDOUT_FILENO, RedirectOp::DupOut, to_string(out.fd)});
+        }
+        CallSite site;
+        return runParsedCommand(inner, site);
+    }
+    inner.redirections.push_back({STDOUT_FILENO, RedirectOp::DupOut, to_string(out_fd)});
+    inner.redirections.push_back({STDERR_FILENO, RedirectOp::DupOut, to_string(err_fd)});
+    CallSite site;
+    entry.status = runParsedCommand(inner, site);
+    close(out_fd);
+    close(err_fd);
+
+    // Unknown commands and signal deaths say nothing about what the command would print
+    bool resolved = shell_functions.count(inner.args[0]) != 0 || site.builtin != Builtin::None || !site.resolved.empty();
+    if (!resolved || entry.status == 127 || entry.status >= 128) {
+        out.stream.flush();
+        replayBlob(out_path, out.fd);
+        replayBlob(err_path, STDERR_FILENO);
+        unlink(out_path.c_str());
+        unlink(err_path.c_str());
+        return entry.status;
+    }
+
+    entry.stdout_blob = storeBlob(dir, out_path);
+    entry.stderr_blob = storeBlob(dir, err_path);
+    string entry_tmp = dir + "/entries/." + key.hex();
+    {
+        ofstream file(entry_tmp);
+        file << "status " << entry.status << "\nstdout " << entry.stdout_blob << "\nstderr " << entry.stderr_blob << "\n";
+    }
+    rename(entry_tmp.c_str(), entry_path.c_str());
+
+    out.stream.flush();
+    replayBlob(dir + "/blobs/" + entry.stdout_blob, out.fd);
+    replayBlob(dir + "/blobs/" + entry.stderr_blob, STDERR_FILENO);
+    enforceCacheLimit(dir, cacheLimit());
+    return entry.status;
+}
+
+std::string formatNanos(uint64_t ns) {
+    char buf[32];
+    if (ns < 1000) {
+        snprintf(buf, sizeof(buf), "%lluns", (unsigned long long)ns);
+    } else if (ns < 1000000) {
+        snprintf(buf, sizeof(buf), "%.1fus", ns / 1e3);
+    } else if (ns < 1000000000) {
+        snprintf(buf, sizeof(buf), "%.1fms", ns / 1e6);
+    } else {
+        snprintf(buf, sizeof(buf), "%.2fs", ns / 1e9);
+    }
+    return buf;
+}
+
+void writeHistogramText(std::ostream& out, const char* name, const LatencyHistogram& histogram) {
+    out << name << ": count " << histogram.total;
+    if (histogram.total > 0) {
+        out << "  mean " << formatNanos(histogram.sum / histogram.total)
+            << "  p50 " << formatNanos(histogram.percentile(50))
+            << "  p90 " << formatNanos(histogram.percentile(90))
+            << "  p99 " << formatNanos(histogram.percentile(99))
+            << "  max " << formatNanos(histogram.max);
+    }
+    out << endl;
+}
+
+void writeHistogramJson(std::ostream& out, const LatencyHistogram& histogram) {
+    out << "{\"count\": " << histogram.total
+        << ", \"mean\": " << (histogram.total > 0 ? histogram.sum / histogram.total : 0)
+        << ", \"p50\": " << histogram.percentile(50)
+        << ", \"p90\": " << histogram.percentile(90)
+        << ", \"p99\": " << histogram.percentile(99)
+        << ", \"max\": " << histogram.max << "}";
+}
+
+void writeShellStatsText(std::ostream& out) {
+    out << "commands: " << shell_stats.commands << endl;
+    out << "forks: " << shell_stats.forks << endl;
+    out << "failed PATH probes: " << shell_stats.failed_probes << endl;
+    out << "PATH hash hits: " << shell_stats.path_hash_hits << endl;
+    out << "call site hits: " << shell_stats.call_site_hits << endl;
+    out << "cache hits: " << cache_stats.hits << ", misses: " << cache_stats.misses << endl;
+    out << "completions: " << shell_stats.completions << endl;
+    out << "history size: " << history_length << endl;
+    out << "pipelines by depth:";
+    for (size_t depth = 0; depth < shell_stats.pipelines_by_depth.size(); ++depth) {
+        if (shell_stats.pipelines_by_depth[depth] > 0) {
+            out << " " << depth << (depth + 1 == shell_stats.pipelines_by_depth.size() ? "+" : "") << ":" << shell_stats.pipelines_by_depth[depth];
+        }
+    }
+    out << endl;
+    writeHistogramText(out, "completion time", shell_stats.completion_time);
+    writeHistogramText(out, "launch to exec", shell_stats.launch_to_exec);
+    writeHistogramText(out, "command time", shell_stats.command_time);
+    writeHistogramText(out, "watch trigger to start", shell_stats.watch_trigger_to_start);
+}
+
+void writeShellStatsJson(std::ostream& out) {
+    out << "{\"commands\": " << shell_stats.commands
+        << ", \"forks\": " << shell_stats.forks
+        << ", \"failed_path_probes\": " << shell_stats.failed_probes
+        << ", \"path_hash_hits\": " << shell_stats.path_hash_hits
+        << ", \"call_site_hits\": " << shell_stats.call_site_hits
+        << ", \"cache_hits\": " << cache_stats.hits
+        << ", \"cache_misses\": " << cache_stats.misses
+        << ", \"completions\": " << shell_stats.completions
+        << ", \"history_size\": " << history_length
+        << ", \"pipelines_by_depth\": {";
+    bool first = true;
+    for (size_t depth = 0; depth < shell_stats.pipelines_by_depth.size(); ++depth) {
+        if (shell_stats.pipelines_by_depth[depth] > 0) {
+            out << (first ? "" : ", ") << "\"" << depth << "\": " << shell_stats.pipelines_by_depth[depth];
+            first = false;
+        }
+    }
+    out << "}, \"completion_time_ns\": ";
+    writeHistogramJson(out, shell_stats.completion_time);
+    out << ", \"launch_to_exec_ns\": ";
+    writeHistogramJson(out, shell_stats.launch_to_exec);
+    out << ", \"command_time_ns\": ";
+    writeHistogramJson(out, shell_stats.command_time);
+    out << ", \"watch_trigger_to_start_ns\": ";
+    writeHistogramJson(out, shell_stats.watch_trigger_to_start);
+    out << "}" << endl;
+}
+
+// shellstat [--json] [--reset]
+int runShellStat(const std::vector<std::string>& args, BuiltinOutput& out) {
+    bool json = false;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (args[i] == "--json") {
+            json = true;
+        } else if (args[i] == "--reset") {
+            shell_stats = ShellStats();
+            cache_stats = CacheStats();
+            return 0;
+        } else {
+            cerr << "shellstat: usage: shellstat [--json] [--reset]" << endl;
+            return 2;
+        }
+    }
+    if (json) {
+        writeShellStatsJson(out.stream);
+    } else {
+        writeShellStatsText(out.stream);
+    }
+    return 0;
+}
+
+// Write the counters as JSON to SHELLSTAT_FILE when the shell exits
+void dumpShellStats() {
+    char* path = getenv("SHELLSTAT_FILE");
+    if (path == nullptr) {
+        return;
+    }
+    ofstream out(path);
+    if (out.is_open()) {
+        writeShellStatsJson(out);
+    }
+}
+
+// Directories watched by watch-run, by inotify watch descriptor. A file given
+// with -p is watched through its directory so editors that replace it are seen
+struct WatchDir {
+    std::string path;
+    bool whole = false;               // Every entry counts, and subdirectories are watched too
+    std::vector<std::string> names;   // Otherwise only these entries count
+};
+
+struct WatchSet {
+    int fd = -1;
+    std::unordered_map<int, WatchDir> dirs;
+};
+
+constexpr uint32_t WATCH_EVENTS = IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+
+// Watch a directory and every non-hidden directory below it
+bool addWatchTree(WatchSet& watch, const std::string& dir) {
+    int wd = inotify_add_watch(watch.fd, dir.c_str(), WATCH_EVENTS | IN_ONLYDIR);
+    if (wd == -1) {
+        return false;
+    }
+    WatchDir& entry = watch.dirs[wd];
+    entry.path = dir;
+    entry.whole = true;
+
+    DIR* dirp = opendir(dir.c_str());
+    if (dirp == nullptr) {
+        return true;
+    }
+    struct dirent* ent;
+    while ((ent = readdir(dirp)) != nullptr) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+        string child = dir + "/" + ent->d_name;
+        struct stat st;
+        bool is_dir = ent->d_type == DT_DIR ||
+            (ent->d_type == DT_UNKNOWN && lstat(child.c_str(), &st) == 0 && S_ISDIR(st.st_mode));
+        if (is_dir) {
+            addWatchTree(watch, child);
+        }
+    }
+    closedir(dirp);
+    return true;
+}
+
+bool addWatchPath(WatchSet& watch, const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+        return addWatchTree(watch, path);
+    }
+    size_t slash = path.rfind('/');
+    string dir = slash == string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+    int wd = inotify_add_watch(watch.fd, dir.c_str(), WATCH_EVENTS | IN_ONLYDIR);
+    if (wd == -1) {
+        return false;
+    }
+    WatchDir& entry = watch.dirs[wd];
+    entry.path = dir;
+    entry.names.push_back(path.substr(slash + 1));
+    return true;
+}
+
+// Read pending events, returning the first watched path that changed or an
+// empty string when none of them matter
+std::string readWatchEvents(WatchSet& watch) {
+    alignas(struct inotify_event) char buffer[16384];
+    string changed;
+    while (true) {
+        ssize_t n = read(watch.fd, buffer, sizeof(buffer));
+        if (n <= 0) {
+            break;
+        }
+        for (char* p = buffer; p < buffer + n;) {
+            auto* event = reinterpret_cast<struct inotify_event*>(p);
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                changed = changed.empty() ? "(event queue overflow)" : changed;
+                continue;
+            }
+            auto it = watch.dirs.find(event->wd);
+            if (it == watch.dirs.end()) {
+                continue;
+            }
+            if (event->mask & IN_IGNORED) {
+                watch.dirs.erase(it);
+                continue;
+            }
+            const WatchDir& dir = it->second;
+            string name = event->len > 0 ? event->name : "";
+            if (!dir.whole && std::find(dir.names.begin(), dir.names.end(), name) == dir.names.end()) {
+                continue;
+            }
+            string path = name.empty() ? dir.path : dir.path + "/" + name;
+            if (dir.whole && (event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)) && name[0] != '.') {
+                addWatchTree(watch, path);
+            }
+            if (changed.empty()) {
+                changed = path;
+            }
+        }
+    }
+    return changed;
+}
+
+volatile sig_atomic_t watch_interrupted = 0;
+
+void onWatchInterrupt(int) {
+    watch_interrupted = 1;
+}
+
+// Stop a cancellable run: it leads its own process group, so whatever it launched goes too
+int stopWatchRun(pid_t pid) {
+    kill(-pid, SIGTERM);
+    int status;
+    waitpid(pid, &status, 0);
+    return decodeWaitStatus(status);
+}
+
+// watch-run [-p path]... [-d ms] [-c] [--] command [args...]
+int runWatch(const std::vector<std::string>& args, BuiltinOutput& out) {
+    std::vector<std::string> paths;
+    uint64_t debounce_ms = 100;
+    bool cancel = false;
+
+    size_t i = 1;
+    for (; i < args.size() && args[i].size() > 1 && args[i][0] == '-'; ++i) {
+        if (args[i] == "--") {
+            ++i;
+            break;
+        } else if (args[i] == "-p" && i + 1 < args.size()) {
+            paths.push_back(args[++i]);
+        } else if (args[i] == "-d" && i + 1 < args.size() && isdigit(static_cast<unsigned char>(args[i + 1][0]))) {
+            debounce_ms = stoull(args[++i]);
+        } else if (args[i] == "-c") {
+            cancel = true;
+        } else {
+            cerr << "watch-run: " << args[i] << ": invalid option" << endl;
+            return 2;
+        }
+    }
+    if (i >= args.size()) {
+        cerr << "watch-run: usage: watch-run [-p path]... [-d ms] [-c] [--] command [args...]" << endl;
+        return 2;
+    }
+    if (paths.empty()) {
+        paths.push_back(".");
+    }
+
+    ParsedCommand inner;
+    inner.args.assign(args.begin() + i, args.end());
+    if (out.fd != STDOUT_FILENO) {
+        inner.redirections.push_back({STDOUT_FILENO, RedirectOp::DupOut, to_string(out.fd)});
+    }
+
+    WatchSet watch;
+    watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch.fd == -1) {
+        cerr << "watch-run: inotify: " << strerror(errno) << endl;
+        return 1;
+    }
+    for (const string& path : paths) {
+        if (!addWatchPath(watch, path)) {
+            cerr << "watch-run: " << path << ": " << strerror(errno) << endl;
+            close(watch.fd);
+            return 1;
+        }
+    }
+
+    // Ctrl-C ends the watch instead of the shell; without SA_RESTART it also wakes poll()
+    struct sigaction action = {};
+    struct sigaction previous;
+    action.sa_handler = onWatchInterrupt;
+    sigemptyset(&action.sa_mask);
+    watch_interrupted = 0;
+    sigaction(SIGINT, &action, &previous);
+
+    CallSite site;
+    pid_t running = -1;   // Cancellable run in progress
+    int running_fd = -1;  // pidfd that becomes readable when it exits
+    int status = 0;
+    bool pending = true;  // The first run starts right away
+    string trigger;
+    uint64_t trigger_time = 0;
+    uint64_t last_event = 0;
+
+    while (!watch_interrupted) {
+        uint64_t now = monotonicNanos();
+        if (pending && (trigger.empty() || now - last_event >= debounce_ms * 1000000) && (running == -1 || cancel)) {
+            if (running != -1) {
+                close(running_fd);
+                status = stopWatchRun(running);
+                running = -1;
+                cerr << "watch-run: cancelled the previous run" << endl;
+            }
+            if (!trigger.empty()) {
+                uint64_t latency = monotonicNanos() - trigger_time;
+                shell_stats.watch_trigger_to_start.record(latency);
+                cerr << "watch-run: " << trigger << " changed, starting after " << formatNanos(latency) << endl;
+            }
+            pending = false;
+            trigger.clear();
+
+            out.stream.flush();
+            if (!cancel) {
+                // Runs are waited for in the shell, changes made meanwhile queue up for the next one
+                status = runParsedCommand(inner, site);
+                out.stream << std::flush;
+                continue;
+            }
+            shell_stats.forks++;
+            running = fork();
+            if (running == 0) {
+                enterSubshell();
+                setpgid(0, 0);
+                signal(SIGINT, SIG_DFL);
+                exit(runParsedCommand(inner, site));
+            }
+            if (running == -1) {
+                cerr << "watch-run: fork: " << strerror(errno) << endl;
+                status = 1;
+                break;
+            }
+            setpgid(running, running);
+            running_fd = syscall(SYS_pidfd_open, running, 0);
+        }
+
+        struct pollfd fds[2] = {{watch.fd, POLLIN, 0}, {running_fd, POLLIN, 0}};
+        int timeout = -1;
+        if (!trigger.empty()) {
+            uint64_t waited = (now - last_event) / 1000000;
+            timeout = waited >= debounce_ms ? 0 : static_cast<int>(debounce_ms - waited);
+        }
+        if (running != -1 && running_fd == -1) {
+            timeout = timeout == -1 ? 50 : std::min(timeout, 50);  // No pidfd, so poll for the exit
+        }
+        if (poll(fds, running != -1 ? 2 : 1, timeout) == -1 && errno != EINTR) {
+            break;
+        }
+
+        if (running != -1) {
+            int wait_status;
+            if (waitpid(running, &wait_status, WNOHANG) == running) {
+                status = decodeWaitStatus(wait_status);
+                if (running_fd != -1) {
+                    close(running_fd);
+                }
+                running = -1;
+                running_fd = -1;
+            }
+        }
+
+        string changed = readWatchEvents(watch);
+        if (!changed.empty()) {
+            last_event = monotonicNanos();
+            if (trigger.empty()) {
+                trigger = changed;
+                trigger_time = last_event;
+            }
+            pending = true;
+        }
+    }
+
+    if (running != -1) {
+        if (running_fd != -1) {
+            close(running_fd);
+        }
+        status = stopWatchRun(running);
+    }
+    sigaction(SIGINT, &previous, nullptr);
+    close(watch.fd);
+    return status;
+}
+
+int builtinEcho(const std::vector<std::string>& args, BuiltinOutput& out) {
+    for (size_t i = 1; i < args.size(); ++i) {
+        out.stream << args[i];
+        if (i < args.size() - 1) {
+            out.stream << " ";
+        }
+    }
+    out.stream << endl;
+    return 0;
+}
+
+int builtinExit(const std::vector<std::string>& args, BuiltinOutput& out) {
+    out.stream.flush();
+    exitShell(args.size() > 1 ? atoi(args[1].c_str()) : last_status);
+}
+
+int builtinType(const std::vector<std::string>& args, BuiltinOutput& out) {
+    if (args.size() < 2) {
+        out.stream << "type: missing argument" << endl;
+        return 1;
+    }
+    const string& target = args[1];
+    auto alias = shell_aliases.find(target);
+    if (alias != shell_aliases.end()) {
+        out.stream << target << " is aliased to `" << alias->second.value << "'" << endl;
+    } else if (shell_functions.count(target)) {
+        out.stream << target << " is a function" << endl;
+    } else if (lookupBuiltin(target) != Builtin::None) {
+        out.stream << target << " is a shell builtin" << endl;
+    } else {
+        string fullPath = resolveCommand(target);
+        if (fullPath.empty()) {
+            out.stream << target << ": not found" << endl;
+            return 1;
+        }
+        out.stream << target << " is " << fullPath << endl;
+    }
+    return 0;
+}
+
+int builtinPwd(const std::vector<std::string>& args, BuiltinOutput& out) {
+    char cwd[1024];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+        out.stream << "pwd: error getting current directory" << endl;
+        return 1;
+    }
+    out.stream << cwd << endl;
+    return 0;
+}
+
+int builtinCd(const std::vector<std::string>& args, BuiltinOutput& out) {
+    if (args.size() < 2) {
+        // No argument provided, do nothing for now (future stages may handle this)
+        return 0;
+    }
+    const std::string& dir = args[1];
+    if (dir == "~") {
+        char* home = getenv("HOME");
+        if (home == nullptr) {
+            out.stream << "cd: HOME environment variable not set" << std::endl;
+            return 1;
+        }
+        if (chdir(home) != 0) {
+            out.stream << "cd: " << home << ": No such file or directory" << std::endl;
+            return 1;
+        }
+    } else if (chdir(dir.c_str()) != 0) {
+        out.stream << "cd: " << dir << ": No such file or directory" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Fingerprints of the lines in the readline history with how often each
+// occurs, so duplicates are found without scanning the list
+std::unordered_map<uint64_t, uint32_t> history_fingerprints;
+
+constexpr long DEFAULT_HISTSIZE = 1000;
+
+// Lines added so far; entries leave the front of the list, so history -a
+// remembers this count per file rather than an index into the list
+uint64_t history_added = 0;
+std::map<std::string, uint64_t> history_appended;
+
+// Entry limit from HISTSIZE or HISTFILESIZE; negative means unlimited
+long historyLimit(const char* name, long fallback) {
+    char* value = getenv(name);
+    if (value == nullptr || *value == '\0') {
+        return fallback;
+    }
+    char* end;
+    long limit = strtol(value, &end, 10);
+    return *end == '\0' ? limit : fallback;
+}
+
+void forgetHistoryEntry(HIST_ENTRY* entry) {
+    if (entry == nullptr) {
+        return;
+    }
+    auto it = history_fingerprints.find(fingerprint64(entry->line));
+    if (it != history_fingerprints.end() && --it->second == 0) {
+        history_fingerprints.erase(it);
+    }
+    free_history_entry(entry);
+}
+
+// Add a line to the in-memory history, honouring HISTCONTROL and HISTSIZE
+void addHistoryLine(const std::string& line) {
+    bool ignore_space = false;
+    bool ignore_dups = false;
+    bool erase_dups = false;
+    char* control = getenv("HISTCONTROL");
+    if (control != nullptr) {
+        istringstream stream(control);
+        string mode;
+        while (getline(stream, mode, ':')) {
+            ignore_space = ignore_space || mode == "ignorespace" || mode == "ignoreboth";
+            ignore_dups = ignore_dups || mode == "ignoredups" || mode == "ignoreboth";
+            erase_dups = erase_dups || mode == "erasedups";
+        }
+    }
+    if (line.empty() || (ignore_space && line[0] == ' ')) {
+        return;
+    }
+
+    uint64_t fingerprint = fingerprint64(line);
+    if (history_fingerprints.count(fingerprint)) {
+        HIST_ENTRY** the_list = history_list();
+        if (ignore_dups && history_length > 0 && line == the_list[history_length - 1]->line) {
+            return;
+        }
+        if (erase_dups) {
+            for (int i = history_length - 1; i >= 0; --i) {
+                if (line == history_list()[i]->line) {
+                    forgetHistoryEntry(remove_history(i));
+                }
+            }
+        }
+    }
+    add_history(line.c_str());
+    history_fingerprints[fingerprint]++;
+    history_added++;
+
+    long limit = historyLimit("HISTSIZE", DEFAULT_HISTSIZE);
+    while (limit >= 0 && history_length > limit) {
+        forgetHistoryEntry(remove_history(0));
+    }
+}
+
+void clearHistory() {
+    clear_history();
+    history_fingerprints.clear();
+    history_appended.clear();
+}
+
+// Load a history file, skipping lines that are already in memory
+bool readHistoryFile(const std::string& path) {
+    ifstream file(path);
+    if (!file.is_open()) {
+        return false;
+    }
+    // Skip lines the session already had; repeats within the file itself are
+    // left to HISTCONTROL like any other new line
+    std::unordered_set<uint64_t> loaded;
+    for (const auto& [fingerprint, count] : history_fingerprints) {
+        loaded.insert(fingerprint);
+    }
+    string line;
+    while (getline(file, line)) {
+        if (!line.empty() && !loaded.count(fingerprint64(line))) {
+            addHistoryLine(line);
+        }
+    }
+    return true;
+}
+
+// Rewrite a history file keeping only the most recent copy of each line and
+// at most HISTFILESIZE lines. The file is read once from the end, so memory
+// is bounded by what is kept rather than by the size of the file.
+bool compactHistoryFile(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    long limit = historyLimit("HISTFILESIZE", historyLimit("HISTSIZE", DEFAULT_HISTSIZE));
+    size_t max_lines = limit < 0 ? SIZE_MAX : static_cast<size_t>(limit);
+
+    std::unordered_set<uint64_t> seen;
+    std::vector<std::string> kept;  // Newest first
+    auto keep = [&](std::string line) {
+        if (!line.empty() && kept.size() < max_lines && seen.insert(fingerprint64(line)).second) {
+            kept.push_back(std::move(line));
+        }
+    };
+
+    struct stat st = {};
+    st.st_mode = 0600;
+    off_t pos = fstat(fd, &st) == 0 ? st.st_size : 0;
+    char buffer[65536];
+    string pending;  // Start of a line whose end was in the block read before
+    while (pos > 0 && kept.size() < max_lines) {
+        size_t n = std::min<off_t>(pos, sizeof(buffer));
+        pos -= n;
+        if (pread(fd, buffer, n, pos) != static_cast<ssize_t>(n)) {
+            close(fd);
+            return false;
+        }
+        string block(buffer, n);
+        block += pending;
+        size_t end = block.size();
+        size_t newline;
+        while (end > 0 && (newline = block.rfind('\n', end - 1)) != string::npos) {
+            keep(block.substr(newline + 1, end - newline - 1));
+            end = newline;
+        }
+        pending = block.substr(0, end);
+    }
+    if (pos == 0) {
+        keep(pending);
+    }
+    close(fd);
+
+    size_t slash = path.rfind('/');
+    string tmp = slash == string::npos ? "." + path + ".compact" :
+        path.substr(0, slash + 1) + "." + path.substr(slash + 1) + ".compact";
+    // The copy gets the original's mode, a private history must not become readable
+    unlink(tmp.c_str());
+    int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, st.st_mode & 07777);
+    if (out == -1) {
+        return false;
+    }
+    fchmod(out, st.st_mode & 07777);
+    bool written;
+    {
+        FdStreamBuf buffer_out(out);
+        std::ostream file(&buffer_out);
+        for (auto it = kept.rbegin(); it != kept.rend(); ++it) {
+            file << *it << '\n';
+        }
+        written = static_cast<bool>(file.flush());
+    }
+    if (close(out) != 0 || !written) {
+        unlink(tmp.c_str());
+        return false;
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+int builtinHistory(const std::vector<std::string>& args, BuiltinOutput& out) {
+    if (args.size() > 1 && args[1] == "-c") {
+        clearHistory();
+    } else if (args.size() > 1 && args[1] == "--compact") {
+        // history --compact [file], HISTFILE by default
+        char* histfile = getenv("HISTFILE");
+        string filename = args.size() > 2 ? args[2] : (histfile != nullptr ? histfile : "");
+        if (filename.empty()) {
+            cerr << "history: --compact: no file given and HISTFILE is not set" << endl;
+            return 1;
+        }
+        if (!compactHistoryFile(filename)) {
+            cerr << "history: " << filename << ": " << strerror(errno) << endl;
+            return 1;
+        }
+    } else if (args.size() > 2 && args[1] == "-a") {
+        // history -a <file>
+        string filename = args[2];
+        ofstream file(filename, ios::app);
+        if (file.is_open()) {
+            // Lines added since the last append, as far as they are still in the list
+            uint64_t appended = history_appended.count(filename) ? history_appended[filename] : 0;
+            int count = std::min<uint64_t>(history_added - appended, history_length);
+            HIST_ENTRY **the_list = history_list();
+            for (int i = history_length - count; i < history_length; ++i) {
+                file << the_list[i]->line << endl;
+            }
+            file.close();
+            history_appended[filename] = history_added;
+        }
+    } else if (args.size() > 2 && args[1] == "-r") {
+        // history -r <file>
+        readHistoryFile(args[2]);
+    } else if (args.size() > 2 && args[1] == "-w") {
+        // history -w <file>
+        string filename = args[2];
+        ofstream file(filename);
+        if (file.is_open()) {
+            HIST_ENTRY **the_list = history_list();
+            if (the_list) {
+                for (int i = 0; the_list[i]; ++i) {
+                    file << the_list[i]->line << endl;
+                }
+            }
+            file.close();
+        }
+    } else {
+        HIST_ENTRY **the_list = history_list();
+        if (the_list) {
+            int total_entries = 0;
+            while (the_list[total_entries]) {
+                total_entries++;
+            }
+            
+            // Check if a number argument is provided
+            int limit = total_entries; // Default to showing all entries
+            if (args.size() > 1) {
+                try {
+                    limit = stoi(args[1]);
+                    if (limit < 0) {
+                        limit = total_entries; // If negative, show all
+                    }
+                } catch (const std::exception&) {
+                    limit = total_entries; // If invalid number, show all
+                }
+            }
+            
+            // Calculate starting index to show last 'limit' entries
+            int start_index = total_entries - limit;
+            if (start_index < 0) start_index = 0;
+            
+            for (int i = start_index; i < total_entries; ++i) {
+                out.stream << "    " << (i + 1) << "  " << the_list[i]->line << endl;
+            }
+        }
+    }
+    return 0;
+}
+
+int builtinTrue(const std::vector<std::string>& args, BuiltinOutput& out) {
+    return 0;
+}
+
+int builtinFalse(const std::vector<std::string>& args, BuiltinOutput& out) {
+    return 1;
+}
+
+int builtinExport(const std::vector<std::string>& args, BuiltinOutput& out) {
+    int status = 0;
+    for (size_t i = 1; i < args.size(); ++i) {
+        const string& arg = args[i];
+        size_t eq = arg.find('=');
+        string name = arg.substr(0, eq);
+        if (!isValidName(name)) {
+            cerr << "export: `" << arg << "': not a valid identifier" << endl;
+            status = 1;
+            continue;
+        }
+        auto it = shell_variables.find(name);
+        if (eq != string::npos) {
+            setenv(name.c_str(), arg.c_str() + eq + 1, 1);
+        } else if (it != shell_variables.end()) {
+            setenv(name.c_str(), it->second.c_str(), 1);
+        } else if (getenv(name.c_str()) == nullptr) {
+            setenv(name.c_str(), "", 1);
+        }
+        shell_variables.erase(name);
+    }
+    return status;
+}
+
+// Inside a loop break and continue are compiled to jumps, so reaching here is an error
+int builtinLoopControl(const std::vector<std::string>& args, BuiltinOutput& out) {
+    cerr << args[0] << ": only meaningful in a `for', `while', or `until' loop" << endl;
+    return 1;
+}
+
+int builtinReturn(const std::vector<std::string>& args, BuiltinOutput& out) {
+    cerr << "return: can only `return' from a function" << endl;
+    return 1;
+}
+
+bool isValidAliasName(const std::string& name) {
+    return !name.empty() && name.find_first_of(" \t\n/$'\"=|&;<>()`\\") == string::npos;
+}
+
+std::string quoteAliasValue(const std::string& value) {
+    string quoted = "'";
+    for (char c : value) {
+        quoted += c == '\'' ? string("'\\''") : string(1, c);
+    }
+    return quoted + "'";
+}
+
+// alias [name[=value]...]
+int builtinAlias(const std::vector<std::string>& args, BuiltinOutput& out) {
+    if (args.size() == 1) {
+        std::vector<std::string> names;
+        for (const auto& [name, alias] : shell_aliases) {
+            names.push_back(name);
+        }
+        std::sort(names.begin(), names.end());
+        for (const string& name : names) {
+            out.stream << "alias " << name << "=" << quoteAliasValue(shell_aliases[name].value) << endl;
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (size_t i = 1; i < args.size(); ++i) {
+        size_t eq = args[i].find('=');
+        string name = args[i].substr(0, eq);
+        if (eq == string::npos) {
+            auto it = shell_aliases.find(name);
+            if (it == shell_aliases.end()) {
+                cerr << "alias: " << name << ": not found" << endl;
+                status = 1;
+            } else {
+                out.stream << "alias " << name << "=" << quoteAliasValue(it->second.value) << endl;
+            }
+            continue;
+        }
+        if (!isValidAliasName(name)) {
+            cerr << "alias: `" << name << "': invalid alias name" << endl;
+            status = 1;
+            continue;
+        }
+        Alias alias;
+        alias.value = args[i].substr(eq + 1);
+        string error;
+        if (tokenize(alias.value, alias.tokens, error) != ParseStatus::Ok) {
+            cerr << "alias: " << name << ": " << (error.empty() ? "unterminated quote" : error) << endl;
+            status = 1;
+            continue;
+        }
+        alias.tokens.pop_back();  // End
+        shell_aliases[name] = std::move(alias);
+    }
+    return status;
+}
+
+// unalias [-a] name...
+int builtinUnalias(const std::vector<std::string>& args, BuiltinOutput& out) {
+    if (args.size() < 2) {
+        cerr << "unalias: usage: unalias [-a] name [name ...]" << endl;
+        return 2;
+    }
+    if (args[1] == "-a") {
+        shell_aliases.clear();
+        return 0;
+    }
+    int status = 0;
+    for (size_t i = 1; i < args.size(); ++i) {
+        if (shell_aliases.erase(args[i]) == 0) {
+            cerr << "unalias: " << args[i] << ": not found" << endl;
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Read-only mapping of a journal file, so scans touch pages rather than copying records
+struct MappedFile {
+    const char* data = nullptr;
+    size_t size = 0;
+
+    bool map(const std::string& path) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+        struct stat st = {};
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                data = static_cast<const char*>(mapped);
+                size = st.st_size;
+                madvise(mapped, size, MADV_SEQUENTIAL);
+            }
+        }
+        close(fd);
+        return data != nullptr || st.st_size == 0;
+    }
+
+    ~MappedFile() {
+        if (data != nullptr) {
+            munmap(const_cast<char*>(data), size);
+        }
+    }
+};
+
+std::string_view journalStringAt(const MappedFile& strings, uint64_t offset) {
+    uint32_t length;
+    if (offset > strings.size || strings.size - offset < sizeof(length)) {
+        return "?";
+    }
+    memcpy(&length, strings.data + offset, sizeof(length));
+    if (strings.size - offset - sizeof(length) < length) {
+        return "?";
+    }
+    return std::string_view(strings.data + offset + sizeof(length), length);
+}
+
+std::string formatJournalTime(uint64_t ns) {
+    time_t seconds = ns / 1000000000ull;
+    struct tm local;
+    localtime_r(&seconds, &local);
+    char buf[32];
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &local);
+    return buf;
+}
+
+// journal [slow [N] | failures [N]]
+int runJournal(const std::vector<std::string>& args, BuiltinOutput& out) {
+    string mode = args.size() > 1 ? args[1] : "summary";
+    size_t limit = 10;
+    if (args.size() > 2 && isdigit(static_cast<unsigned char>(args[2][0]))) {
+        limit = stoul(args[2]);
+    }
+    if ((mode != "summary" && mode != "slow" && mode != "failures") || args.size() > 3) {
+        cerr << "journal: usage: journal [slow [N] | failures [N]]" << endl;
+        return 2;
+    }
+    char* path = getenv("SHELL_JOURNAL");
+    if (path == nullptr || *path == '\0') {
+        cerr << "journal: SHELL_JOURNAL is not set" << endl;
+        return 1;
+    }
+
+    MappedFile file;
+    MappedFile strings;
+    if (!file.map(path) || !strings.map(string(path) + ".strings")) {
+        cerr << "journal: " << path << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    if (file.size < sizeof(JournalRecord) || memcmp(file.data, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) {
+        cerr << "journal: " << path << ": not a journal" << endl;
+        return 1;
+    }
+    // A record being appended right now may be incomplete, it is left out
+    const auto* records = reinterpret_cast<const JournalRecord*>(file.data) + 1;
+    size_t count = file.size / sizeof(JournalRecord) - 1;
+
+    if (mode == "summary") {
+        size_t failures = 0;
+        uint64_t wall = 0;
+        for (size_t i = 0; i < count; ++i) {
+            failures += records[i].status != 0;
+            wall += records[i].wall_ns;
+        }
+        out.stream << "records: " << count << endl;
+        if (count > 0) {
+            out.stream << "from " << formatJournalTime(records[0].time_ns) << " to " << formatJournalTime(records[count - 1].time_ns) << endl;
+            char rate[16];
+            snprintf(rate, sizeof(rate), "%.1f%%", 100.0 * failures / count);
+            out.stream << "failed: " << failures << " (" << rate << ")" << endl;
+            out.stream << "total wall time: " << formatNanos(wall) << endl;
+        }
+    } else if (mode == "slow") {
+        // Keep the N slowest in a min-heap, one pass over the records
+        auto faster = [&](size_t a, size_t b) { return records[a].wall_ns > records[b].wall_ns; };
+        std::vector<size_t> heap;
+        heap.reserve(limit + 1);
+        for (size_t i = 0; i < count && limit > 0; ++i) {
+            if (heap.size() < limit) {
+                heap.push_back(i);
+                std::push_heap(heap.begin(), heap.end(), faster);
+            } else if (records[i].wall_ns > records[heap.front()].wall_ns) {
+                std::pop_heap(heap.begin(), heap.end(), faster);
+                heap.back() = i;
+                std::push_heap(heap.begin(), heap.end(), faster);
+            }
+        }
+        std::sort_heap(heap.begin(), heap.end(), faster);
+        for (size_t i : heap) {
+            const JournalRecord& record = records[i];
+            out.stream << formatJournalTime(record.time_ns)
+                       << "  wall " << formatNanos(record.wall_ns)
+                       << "  user " << formatNanos(record.user_ns)
+                       << "  sys " << formatNanos(record.sys_ns)
+                       << "  rss " << record.max_rss_kb << "KiB"
+                       << "  status " << record.status
+                       << "  " << journalStringAt(strings, record.argv_offset) << endl;
+        }
+    } else {
+        // Count per command line first, then fold those into per command name
+        std::unordered_map<uint64_t, std::pair<uint64_t, uint64_t>> by_line;  // Offset -> runs, failures
+        for (size_t i = 0; i < count; ++i) {
+            auto& counts = by_line[records[i].argv_offset];
+            counts.first++;
+            counts.second += records[i].status != 0;
+        }
+        std::unordered_map<std::string_view, std::pair<uint64_t, uint64_t>> by_name;
+        for (const auto& [offset, counts] : by_line) {
+            std::string_view line = journalStringAt(strings, offset);
+            auto& total = by_name[line.substr(0, line.find(' '))];
+            total.first += counts.first;
+            total.second += counts.second;
+        }
+        std::vector<std::pair<std::string_view, std::pair<uint64_t, uint64_t>>> rows(by_name.begin(), by_name.end());
+        std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) {
+            return a.second.second != b.second.second ? a.second.second > b.second.second : a.first < b.first;
+        });
+        for (size_t i = 0; i < rows.size() && i < limit && rows[i].second.second > 0; ++i) {
+            char rate[16];
+            snprintf(rate, sizeof(rate), "%.1f%%", 100.0 * rows[i].second.second / rows[i].second.first);
+            out.stream << rows[i].first << ": " << rows[i].second.second << " of " << rows[i].second.first << " failed (" << rate << ")" << endl;
+        }
+    }
+    return 0;
+}
+
+using BuiltinHandler = int (*)(const std::vector<std::string>& args, BuiltinOutput& out);
+
+// Implementations indexed by Builtin, shared by the shell and pipeline stages
+constexpr std::array<BuiltinHandler, BUILTIN_COUNT> BUILTIN_HANDLERS = {
+    builtinEcho, builtinExit, builtinType, builtinPwd, builtinCd, builtinHistory,
+    builtinTrue, builtinFalse, builtinTrue, builtinExport, builtinLoopControl,
+    builtinLoopControl, builtinReturn, runCache, runShellStat, runWatch,
+    builtinAlias, builtinUnalias, runJournal,
+};
+
+// Flush a builtin's output, reporting a write that failed (e.g. "echo hi >&-")
+int finishBuiltinOutput(const std::string& name, BuiltinOutput& out, int status) {
+    if (out.stream.flush()) {
+        return status;
+    }
+    int err = fcntl(out.fd, F_GETFD) == -1 ? EBADF : errno;
+    cerr << name << ": write error: " << strerror(err) << endl;
+    return 1;
+}
+
+int runBuiltin(Builtin builtin, const ParsedCommand& command) {
+    FdPlan plan;
+    if (!openFdPlan(command.redirections, plan)) {
+        return 1;
+    }
+
+    // Output-only redirections are handed to the builtin as its output fd;
+    // anything else is applied to the shell and undone afterwards
+    bool stdout_only = !plan.moves.empty();
+    for (const auto& [target, source] : plan.moves) {
+        stdout_only = stdout_only && target == STDOUT_FILENO && source != -1;
+    }
+    BuiltinHandler handler = BUILTIN_HANDLERS[static_cast<size_t>(builtin)];
+    int status;
+    if (stdout_only) {
+        cout.flush();
+        {
+            FdStreamBuf buffer(plan.moves.back().second);
+            std::ostream stream(&buffer);
+            BuiltinOutput out{buffer.fd, stream};
+            status = finishBuiltinOutput(command.args[0], out, handler(command.args, out));
+        }
+        closeFdPlan(plan);
+    } else {
+        applyFdPlan(plan);
+        BuiltinOutput out{STDOUT_FILENO, cout};
+        status = finishBuiltinOutput(command.args[0], out, handler(command.args, out));
+        restoreFdPlan(plan);
+    }
+    return status;
+}
+
+// Run a pipeline stage in its forked child, whose redirections are already in place
+void executeCommand(const std::vector<std::string>& args, const std::string& resolved) {
+    if (args.empty()) {
+        exit(0);
+    }
+    const string& command_str = args[0];
+
+    // Shell functions run in this (already forked) process
+    auto function = shell_functions.find(command_str);
+    if (function != shell_functions.end()) {
+        exit(callFunction(*function->second, args));
+    }
+
+    Builtin builtin = lookupBuiltin(command_str);
+    if (builtin != Builtin::None) {
+        BuiltinOutput out{STDOUT_FILENO, cout};
+        int status = BUILTIN_HANDLERS[static_cast<size_t>(builtin)](args, out);
+        cout.flush();
+        exit(status);
+    }
+
+    // The parent already searched PATH through the stage's call site
+    if (resolved.empty()) {
+        cerr << command_str << ": command not found" << endl;
+        exit(127);
+    }
+    vector<char*> execArgs;
+    for (const string& arg : args) {
+        execArgs.push_back(const_cast<char*>(arg.c_str()));
+    }
+    execArgs.push_back(nullptr);
+    execv(resolved.c_str(), execArgs.data());
+    cerr << "Error executing " << command_str << endl;
+    exit(126);
+}
+
+// Look a command name up through its call site, reusing the previous PATH
+// search unless PATH changed or the command was not found
+void resolveCallSite(CallSite& site, const string& command_str) {
+    if (site.name != command_str) {
+        site.name = command_str;
+        site.builtin = lookupBuiltin(command_str);
+        site.resolved.clear();
+    }
+    if (site.builtin != Builtin::None) {
+        return;
+    }
+    char* path = getenv("PATH");
+    string path_env = path != nullptr ? path : "";
+    if (site.resolved.empty() || site.path_env != path_env) {
+        site.resolved = resolveCommand(command_str);
+        site.path_env = path_env;
+    } else {
+        shell_stats.call_site_hits++;
+    }
+}
+
+// Run one command with its redirections, resolving the name through the call site cache
+int runParsedCommand(const ParsedCommand& command, CallSite& site) {
+    if (command.args.empty()) {
+        return 0;
+    }
+    const string& command_str = command.args[0];
+
+    // Functions take precedence over builtins and PATH lookups
+    auto function = shell_functions.find(command_str);
+    if (function != shell_functions.end()) {
+        std::shared_ptr<Program> body = function->second;
+        FdPlan plan;
+        if (!openFdPlan(command.redirections, plan)) {
+            return 1;
+        }
+        applyFdPlan(plan);
+        int status = callFunction(*body, command.args);
+        restoreFdPlan(plan);
+        return status;
+    }
+
+    resolveCallSite(site, command_str);
+    if (site.builtin != Builtin::None) {
+        return runBuiltin(site.builtin, command);
+    }
+    if (site.resolved.empty()) {
+        // The message follows the command's redirections, as its output would have
+        FdPlan plan;
+        if (!openFdPlan(command.redirections, plan)) {
+            return 1;
+        }
+        applyFdPlan(plan);
+        cout << command_str << ": command not found" << endl;
+        restoreFdPlan(plan);
+        return 127;
+    }
+    return runExternal(command, site.resolved);
+}
+
+using SavedEnvironment = std::vector<std::pair<std::string, std::optional<std::string>>>;
+
+std::vector<std::pair<std::string, std::string>> expandAssignments(const SimpleCommand& command) {
+    std::vector<std::pair<std::string, std::string>> assignments;
+    for (size_t i = 0; i < command.assign_count; ++i) {
+        string text = expandWordString(command.words[i]);
+        size_t eq = text.find('=');
+        assignments.emplace_back(text.substr(0, eq), text.substr(eq + 1));
+    }
+    return assignments;
+}
+
+// Export assignments for the duration of one command, remembering what they replaced
+SavedEnvironment exportTemporarily(const std::vector<std::pair<std::string, std::string>>& assignments) {
+    SavedEnvironment saved;
+    for (const auto& [name, value] : assignments) {
+        char* old = getenv(name.c_str());
+        saved.emplace_back(name, old != nullptr ? std::optional<std::string>(old) : std::nullopt);
+        setenv(name.c_str(), value.c_str(), 1);
+    }
+    return saved;
+}
+
+void restoreEnvironment(const SavedEnvironment& saved) {
+    for (auto it = saved.rbegin(); it != saved.rend(); ++it) {
+        if (it->second) {
+            setenv(it->first.c_str(), it->second->c_str(), 1);
+        } else {
+            unsetenv(it->first.c_str());
+        }
+    }
+}
+
+int runSimpleCommand(SimpleCommand& command) {
+    std::vector<std::pair<std::string, std::string>> assignments = expandAssignments(command);
+
+    std::vector<std::string> args;
+    for (size_t i = command.assign_count; i < command.words.size(); ++i) {
+        expandWord(command.words[i], args);
+    }
+
+    ParsedCommand parsed;
+    parsed.args = std::move(args);
+    parsed.redirections = expandRedirects(command.redirects);
+
+    if (parsed.args.empty()) {
+        for (const auto& [name, value] : assignments) {
+            setVariable(name, value);
+        }
+        // A bare redirection still creates or truncates its files
+        FdPlan plan;
+        bool opened = openFdPlan(parsed.redirections, plan);
+        closeFdPlan(plan);
+        return opened ? 0 : 1;
+    }
+
+    // Assignments before a command only apply to that command's environment
+    SavedEnvironment saved = exportTemporarily(assignments);
+    shell_stats.commands++;
+    uint64_t started = monotonicNanos();
+    int status = runParsedCommand(parsed, command.site);
+    shell_stats.command_time.record(monotonicNanos() - started);
+    restoreEnvironment(saved);
+    return status;
+}
+
+int runPipelineStages(Program& program, const std::vector<PipelineStage>& stages) {
+    ParsedCommand pipeline;
+    pipeline.is_pipeline = true;
+    for (const PipelineStage& stage : stages) {
+        std::vector<std::string> args;
+        std::vector<Redirection> redirections;
+        std::vector<std::pair<std::string, std::string>> assignments;
+        string resolved;
+        if (!stage.body) {
+            SimpleCommand& command = program.commands[stage.command];
+            assignments = expandAssignments(command);
+            for (size_t i = command.assign_count; i < command.words.size(); ++i) {
+                expandWord(command.words[i], args);
+            }
+            redirections = expandRedirects(command.redirects);
+
+            // Resolve in the parent so every stage reuses its call site across runs;
+            // a PATH=... prefix has to be in effect for the search
+            if (!args.empty() && shell_functions.count(args[0]) == 0) {
+                SavedEnvironment saved = exportTemporarily(assignments);
+                resolveCallSite(command.site, args[0]);
+                restoreEnvironment(saved);
+                if (command.site.builtin == Builtin::None) {
+                    resolved = command.site.resolved;
+                }
+            }
+        }
+        pipeline.pipeline_commands.push_back(std::move(args));
+        pipeline.pipeline_redirections.push_back(std::move(redirections));
+        pipeline.pipeline_bodies.push_back(stage.body);
+        pipeline.pipeline_assignments.push_back(std::move(assignments));
+        pipeline.pipeline_paths.push_back(std::move(resolved));
+    }
+    shell_stats.commands += stages.size();
+    uint64_t started = monotonicNanos();
+    int status = executePipeline(pipeline);
+    shell_stats.command_time.record(monotonicNanos() - started);
+    return status;
+}
+
+const int MAX_FUNCTION_DEPTH = 1000;
+int function_depth = 0;
+
+int callFunction(Program& body, const std::vector<std::string>& args) {
+    if (function_depth >= MAX_FUNCTION_DEPTH) {
+        cerr << args[0] << ": maximum function nesting level exceeded" << endl;
+        return 1;
+    }
+
+    std::vector<std::string> saved = std::move(positional_params);
+    positional_params.assign(args.begin() + 1, args.end());
+    ++function_depth;
+    int status = runProgram(body);
+    --function_depth;
+    positional_params = std::move(saved);
+    return status;
+}
+
+// State of one active loop; slots are assigned per nesting depth at compile time
+struct LoopSlot {
+    std::vector<std::string> items;
+    size_t next = 0;
+    const std::string* var = nullptr;
+    int saved_status = 0;
+};
+
+int runProgram(Program& program) {
+    std::vector<LoopSlot> slots(program.loop_slots);
+    std::vector<FdPlan> redirects;
+    string case_subject;
+    size_t pc = 0;
+
+    while (pc < program.code.size()) {
+        const Instr& ins = program.code[pc++];
+        switch (ins.op) {
+            case OpCode::Run:
+                last_status = runSimpleCommand(program.commands[ins.a]);
+                break;
+            case OpCode::Pipeline:
+                last_status = runPipelineStages(program, program.pipelines[ins.a]);
+                break;
+            case OpCode::Subshell: {
+                shell_stats.forks++;
+                pid_t pid = fork();
+                if (pid == 0) {
+                    enterSubshell();
+                    exit(runProgram(*program.bodies[ins.a]));
+                } else if (pid < 0) {
+                    cerr << "Error forking process" << endl;
+                    last_status = 1;
+                } else {
+                    int status;
+                    waitpid(pid, &status, 0);
+                    last_status = decodeWaitStatus(status);
+                }
+                break;
+            }
+            case OpCode::Jump:
+                pc = ins.a;
+                break;
+            case OpCode::JumpIfFail:
+                if (last_status != 0) {
+                    pc = ins.a;
+                }
+                break;
+            case OpCode::JumpIfOk:
+                if (last_status == 0) {
+                    pc = ins.a;
+                }
+                break;
+            case OpCode::Negate:
+                last_status = last_status == 0 ? 1 : 0;
+                break;
+            case OpCode::SetStatus:
+                last_status = ins.a;
+                break;
+            case OpCode::SaveStatus:
+                slots[ins.a].saved_status = last_status;
+                break;
+            case OpCode::RestoreStatus:
+                last_status = slots[ins.a].saved_status;
+                break;
+            case OpCode::ForInit: {
+                const ForLoop& loop = program.for_loops[ins.a];
+                LoopSlot& slot = slots[ins.b];
+                slot.items.clear();
+                if (loop.has_in) {
+                    for (const Word& word : loop.items) {
+                        expandWord(word, slot.items);
                     }
+                } else {
+                    slot.items = positional_params;
                 }
-                
-                // Calculate starting index to show last 'limit' entries
-                int start_index = total_entries - limit;
-                if (start_index < 0) start_index = 0;
-                
-                for (int i = start_index; i < total_entries; ++i) {
-                    cout << "    " << (i + 1) << "  " << the_list[i]->line << endl;
+                slot.next = 0;
+                slot.var = &loop.var;
+                last_status = 0;
+                break;
+            }
+            case OpCode::ForNext: {
+                LoopSlot& slot = slots[ins.b];
+                if (slot.next >= slot.items.size()) {
+                    pc = ins.a;
+                } else {
+                    setVariable(*slot.var, slot.items[slot.next++]);
                 }
+                break;
             }
-            restoreRedirection(state);
-        } else if (command_str == "cd") {
-            if (command.args.size() < 2) {
-                // No argument provided, do nothing for now (future stages may handle this)
-                continue;
+            case OpCode::CaseSubject:
+                case_subject = expandWordString(program.case_subjects[ins.a]);
+                last_status = 0;
+                break;
+            case OpCode::CaseMatch: {
+                bool matched = false;
+                for (const Word& pattern : program.case_patterns[ins.b]) {
+                    if (fnmatch(expandPattern(pattern).c_str(), case_subject.c_str(), 0) == 0) {
+                        matched = true;
+                        break;
+                    }
+                }
+                if (!matched) {
+                    pc = ins.a;
+                }
+                break;
             }
-            const std::string& dir = command.args[1];
-            if (dir == "~") {
-                char* home = getenv("HOME");
-                if (home == nullptr) {
-                    std::cout << "cd: HOME environment variable not set" << std::endl;
-                    continue;
+            case OpCode::Define:
+                shell_functions[program.names[ins.b]] = program.bodies[ins.a];
+                last_status = 0;
+                break;
+            case OpCode::PushRedirects: {
+                FdPlan plan;
+                if (!openFdPlan(expandRedirects(program.redirect_lists[ins.b]), plan)) {
+                    last_status = 1;
+                    pc = ins.a;
+                    break;
                 }
-                if (chdir(home) != 0) {
-                    std::cout << "cd: " << home << ": No such file or directory" << std::endl;
+                applyFdPlan(plan);
+                redirects.push_back(std::move(plan));
+                break;
+            }
+            case OpCode::PopRedirects:
+                restoreFdPlan(redirects.back());
+                redirects.pop_back();
+                break;
+            case OpCode::Return: {
+                std::vector<std::string> args;
+                for (const Word& word : program.commands[ins.a].words) {
+                    expandWord(word, args);
                 }
-            } else {
-                if (chdir(dir.c_str()) != 0) {
-                    std::cout << "cd: " << dir << ": No such file or directory" << std::endl;
+                if (args.size() > 1) {
+                    last_status = atoi(args[1].c_str()) & 0xff;
                 }
+                while (!redirects.empty()) {
+                    restoreFdPlan(redirects.back());
+                    redirects.pop_back();
+                }
+                return last_status;
             }
-        } else {
-            // Try to execute as external command
-            char* path = getenv("PATH");
-            if (path == nullptr) {
-                cout << command_str << ": command not found" << endl;
+        }
+    }
+    return last_status;
+}
+
+// Tokenize and parse a complete input, reporting whether more lines are needed
+ParseStatus parseInput(const std::string& input, std::unique_ptr<Node>& tree, std::string& error) {
+    std::vector<Token> tokens;
+    ParseStatus status = tokenize(input, tokens, error);
+    if (status == ParseStatus::Incomplete) {
+        error = "syntax error: unexpected end of file";
+    }
+    if (status != ParseStatus::Ok) {
+        return status;
+    }
+
+    Parser parser{tokens};
+    try {
+        tree = parser.parseProgram();
+    } catch (const ParseError& e) {
+        error = e.message;
+        return e.status;
+    }
+    return ParseStatus::Ok;
+}
+
+// Run the startup file, $SHELLRC or ~/.shellrc, once before the first prompt.
+// Commands run as soon as they are complete, so an alias defined on one line
+// applies to the lines after it.
+void loadRcFile() {
+    char* rc = getenv("SHELLRC");
+    char* home = getenv("HOME");
+    string path = rc != nullptr ? rc : (home != nullptr ? string(home) + "/.shellrc" : "");
+    ifstream file(path);
+    if (path.empty() || !file.is_open()) {
+        return;
+    }
+
+    string input;
+    string line;
+    while (getline(file, line)) {
+        input += input.empty() ? line : "\n" + line;
+        std::unique_ptr<Node> tree;
+        string error;
+        ParseStatus status = parseInput(input, tree, error);
+        if (status == ParseStatus::Incomplete) {
+            continue;
+        }
+        input.clear();
+        if (status != ParseStatus::Ok) {
+            cerr << path << ": " << error << endl;
+            continue;
+        }
+        Program program;
+        Compiler compiler{program, false};
+        compiler.reserve(*tree);
+        compiler.compile(*tree);
+        runProgram(program);
+    }
+    if (!input.empty()) {
+        cerr << path << ": syntax error: unexpected end of file" << endl;
+    }
+}
+
+// Collapse a multi-line command into one history entry that still parses
+std::string joinContinuationLines(const std::string& input) {
+    string result;
+    istringstream lines(input);
+    string line;
+    while (getline(lines, line)) {
+        if (!result.empty()) {
+            size_t end = result.find_last_not_of(" \t");
+            size_t start = result.find_last_of(" \t;|", end);
+            string last_word = result.substr(start == string::npos ? 0 : start + 1, end - (start == string::npos ? 0 : start + 1) + 1);
+            char last = result[end];
+            bool opens_block = last_word == "do" || last_word == "then" || last_word == "else" || last_word == "in" || last_word == "{";
+            result += (opens_block || last == ';' || last == '|' || last == '&' || last == '(' || last == ')') ? " " : "; ";
+        }
+        result += line;
+    }
+    return result;
+}
+
+// Daemon mode: `shell --serve SOCK` keeps one warm shell (PATH already hashed,
+// functions and variables from startup) and runs each request in a forked copy
+// of it. A request is a sequence of frames, each a type byte, a 32-bit length
+// and a payload:
+//   D <cwd>       optional working directory for the command
+//   C <command>   command text; when it carries the client's stdin, stdout and
+//                 stderr as SCM_RIGHTS the output streams straight to them,
+//                 otherwise stdout and stderr are captured and sent back
+// and the reply is any number of O/E frames (captured stdout/stderr) followed by
+//   X <status>    exit status as a 32-bit integer
+int serve_client_fd = -1;
+bool serve_capture = false;
+
+bool writeAll(int fd, const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool readAll(int fd, void* data, size_t size) {
+    char* bytes = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = read(fd, bytes, size);
+        if (n <= 0) {
+            return false;
+        }
+        bytes += n;
+        size -= n;
+    }
+    return true;
+}
+
+// Send one frame, optionally passing descriptors along with its header
+bool sendFrame(int fd, char type, const std::string& payload, const std::vector<int>& fds = {}) {
+    char header[5];
+    uint32_t size = payload.size();
+    header[0] = type;
+    memcpy(header + 1, &size, sizeof(size));
+
+    struct iovec iov = {header, sizeof(header)};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    std::vector<char> control;
+    if (!fds.empty()) {
+        control.resize(CMSG_SPACE(fds.size() * sizeof(int)));
+        msg.msg_control = control.data();
+        msg.msg_controllen = control.size();
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(fds.size() * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds.data(), fds.size() * sizeof(int));
+    }
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(header)) {
+        return false;
+    }
+    return writeAll(fd, payload.data(), payload.size());
+}
+
+// Receive one frame and any descriptors that came with it
+bool recvFrame(int fd, char& type, std::string& payload, std::vector<int>& fds) {
+    char header[5];
+    struct iovec iov = {header, sizeof(header)};
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0) {
+        return false;
+    }
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            std::vector<int> received(count);
+            memcpy(received.data(), CMSG_DATA(cmsg), count * sizeof(int));
+            fds.insert(fds.end(), received.begin(), received.end());
+        }
+    }
+    if (n < (ssize_t)sizeof(header) && !readAll(fd, header + n, sizeof(header) - n)) {
+        return false;
+    }
+    type = header[0];
+    uint32_t size;
+    memcpy(&size, header + 1, sizeof(size));
+    payload.resize(size);
+    return readAll(fd, payload.data(), size);
+}
+
+// Send captured output back in frames of at most 64 KiB
+void sendCaptured(int client, char type, int capture_fd) {
+    lseek(capture_fd, 0, SEEK_SET);
+    std::string chunk(65536, '\0');
+    ssize_t n;
+    while ((n = read(capture_fd, chunk.data(), chunk.size())) > 0) {
+        if (!sendFrame(client, type, chunk.substr(0, n))) {
+            return;
+        }
+    }
+}
+
+// Finish a daemon request: flush or send the output, then the exit status
+[[noreturn]] void finishClientRequest(int status) {
+    cout.flush();
+    if (serve_capture) {
+        sendCaptured(serve_client_fd, 'O', STDOUT_FILENO);
+        sendCaptured(serve_client_fd, 'E', STDERR_FILENO);
+    }
+    int32_t code = status;
+    sendFrame(serve_client_fd, 'X', std::string(reinterpret_cast<char*>(&code), sizeof(code)));
+    _exit(status);
+}
+
+// Forked children exit on their own; only the top-level shell replies or saves history
+void enterSubshell() {
+    in_subshell = true;
+    serve_client_fd = -1;
+}
+
+[[noreturn]] void exitShell(int status) {
+    if (serve_client_fd != -1) {
+        finishClientRequest(status);
+    }
+    if (in_subshell) {
+        exit(status);
+    }
+    dumpShellStats();
+    // Save history to HISTFILE before exiting
+    char* histfile = getenv("HISTFILE");
+    if (histfile != nullptr) {
+        write_history(histfile);
+        long limit = historyLimit("HISTFILESIZE", historyLimit("HISTSIZE", DEFAULT_HISTSIZE));
+        if (limit >= 0) {
+            history_truncate_file(histfile, limit);
+        }
+    }
+    exit(status);
+}
+
+// Runs in a forked copy of the server for one connection
+[[noreturn]] void serveClient(int client) {
+    signal(SIGCHLD, SIG_DFL);
+    serve_client_fd = client;
+
+    char type;
+    string payload;
+    std::vector<int> fds;
+    string command_text;
+    bool have_command = false;
+    string cwd_error;  // Reported to the client once its stderr is in place
+    while (!have_command && recvFrame(client, type, payload, fds)) {
+        if (type == 'D') {
+            if (chdir(payload.c_str()) != 0) {
+                cwd_error = payload + ": " + strerror(errno);
+            }
+        } else if (type == 'C') {
+            command_text = std::move(payload);
+            have_command = true;
+        }
+    }
+    if (!have_command) {
+        _exit(1);
+    }
+
+    if (fds.size() == 3) {
+        for (int fd = 0; fd < 3; ++fd) {
+            dup2(fds[fd], fd);
+            close(fds[fd]);
+        }
+    } else {
+        for (int fd : fds) {
+            close(fd);
+        }
+        serve_capture = true;
+        int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        dup2(devnull, STDIN_FILENO);
+        close(devnull);
+        dup2(memfd_create("stdout", MFD_CLOEXEC), STDOUT_FILENO);
+        dup2(memfd_create("stderr", MFD_CLOEXEC), STDERR_FILENO);
+    }
+
+    // Never run the command somewhere other than where the client is
+    if (!cwd_error.empty()) {
+        cerr << "shell: cannot change directory to " << cwd_error << endl;
+        finishClientRequest(1);
+    }
+
+    std::unique_ptr<Node> tree;
+    string error;
+    if (parseInput(command_text, tree, error) != ParseStatus::Ok) {
+        cerr << error << endl;
+        finishClientRequest(2);
+    }
+    Program program;
+    Compiler compiler{program, false};
+    compiler.reserve(*tree);
+    compiler.compile(*tree);
+    finishClientRequest(runProgram(program));
+}
+
+int serve(const std::string& socket_path) {
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (server == -1 || socket_path.size() >= sizeof(addr.sun_path)) {
+        cerr << "shell: cannot create socket " << socket_path << endl;
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path.c_str());
+    // Only a stale socket is replaced; a mistyped path must not delete a file
+    struct stat st;
+    if (lstat(socket_path.c_str(), &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            cerr << "shell: " << socket_path << ": exists and is not a socket" << endl;
+            return 1;
+        }
+        unlink(socket_path.c_str());
+    }
+    // Requests run as this user, so nobody else may connect: the socket is
+    // created owner-only rather than left to the umask
+    mode_t old_umask = umask(0177);
+    int bound = bind(server, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+    umask(old_umask);
+    if (bound != 0 || chmod(socket_path.c_str(), 0600) != 0 || listen(server, SOMAXCONN) != 0) {
+        cerr << "shell: cannot listen on " << socket_path << ": " << strerror(errno) << endl;
+        return 1;
+    }
+
+    // Warm up once so every request starts from a hashed PATH
+    hashPath();
+
+    // Requests are independent, let the kernel reap their processes
+    signal(SIGCHLD, SIG_IGN);
+    while (true) {
+        int client = accept4(server, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client == -1) {
+            if (errno == EINTR) {
                 continue;
             }
+            cerr << "shell: accept failed: " << strerror(errno) << endl;
+            return 1;
+        }
+        // Also check the peer, in case the socket's directory lets others in by another path
+        struct ucred peer = {};
+        socklen_t peer_len = sizeof(peer);
+        if (getsockopt(client, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) != 0 || peer.uid != getuid()) {
+            close(client);
+            continue;
+        }
+        shell_stats.forks++;
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(server);
+            serveClient(client);
+        } else if (pid < 0) {
+            cerr << "Error forking process" << endl;
+        }
+        close(client);
+    }
+}
 
-            string pathStr(path);
-            istringstream pathStream(pathStr);
-            string dir;
-            bool found = false;
-
-            while (getline(pathStream, dir, ':')) {
-                string fullPath = dir + "/" + command_str;
-                if (access(fullPath.c_str(), X_OK) == 0) {
-                    found = true;
-                    pid_t pid = fork();
-                    if (pid == 0) {
-                        // Child process
-                        
-                        // Handle output redirection if specified
-                        handleRedirection(command);
-                        
-                        vector<char*> execArgs;
-                        execArgs.push_back(const_cast<char*>(command_str.c_str()));  // Use command name instead of full path
-                        for (size_t i = 1; i < command.args.size(); ++i) {
-                            execArgs.push_back(const_cast<char*>(command.args[i].c_str()));
-                        }
-                        execArgs.push_back(nullptr);
-                        execv(fullPath.c_str(), execArgs.data());
-                        cerr << "Error executing " << command_str << endl;
-                        exit(1);
-                    } else if (pid > 0) {
-                        // Parent process
-                        int status;
-                        waitpid(pid, &status, 0);
-                    }
+// `shell --client SOCK [--capture] command...` sends one command to a server
+int runClient(const std::string& socket_path, int argc, char* argv[]) {
+    bool capture = false;
+    if (argc > 0 && string(argv[0]) == "--capture") {
+        capture = true;
+        ++argv;
+        --argc;
+    }
+    string command_text;
+    for (int i = 0; i < argc; ++i) {
+        if (i > 0) {
+            command_text += ' ';
+        }
+        command_text += argv[i];
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (sock == -1 || socket_path.size() >= sizeof(addr.sun_path)) {
+        cerr << "shell: cannot create socket " << socket_path << endl;
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path.c_str());
+    if (connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0) {
+        cerr << "shell: cannot connect to " << socket_path << ": " << strerror(errno) << endl;
+        return 1;
+    }
+
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)) == nullptr) {
+        cerr << "shell: cannot determine the current directory: " << strerror(errno) << endl;
+        close(sock);
+        return 1;
+    }
+    sendFrame(sock, 'D', cwd);
+    std::vector<int> fds;
+    if (!capture) {
+        fds = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    }
+    sendFrame(sock, 'C', command_text, fds);
+
+    char type;
+    string payload;
+    std::vector<int> unused;
+    while (recvFrame(sock, type, payload, unused)) {
+        if (type == 'O' || type == 'E') {
+            int fd = type == 'O' ? STDOUT_FILENO : STDERR_FILENO;
+            for (size_t written = 0; written < payload.size(); ) {
+                ssize_t n = write(fd, payload.data() + written, payload.size() - written);
+                if (n <= 0) {
                     break;
                 }
+                written += n;
             }
+        } else if (type == 'X' && payload.size() == sizeof(int32_t)) {
+            int32_t status;
+            memcpy(&status, payload.data(), sizeof(status));
+            return status;
+        }
+    }
+    cerr << "shell: connection to " << socket_path << " closed" << endl;
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc >= 3 && string(argv[1]) == "--client") {
+        return runClient(argv[2], argc - 3, argv + 3);
+    }
 
-            if (!found) {
-                cout << command_str << ": command not found" << endl;
+    // Aliases and functions from the rc file are parsed once, and a daemon's
+    // connections inherit them from the server process
+    loadRcFile();
+    if (argc >= 3 && string(argv[1]) == "--serve") {
+        return serve(argv[2]);
+    }
+    
+    // Set up readline autocompletion
+    rl_attempted_completion_function = builtin_completion_generator;
+    
+    // Load history from HISTFILE environment variable if set
+    char* histfile = getenv("HISTFILE");
+    if (histfile != nullptr) {
+        readHistoryFile(histfile);
+    }
+    
+    while (true) {
+        char* input_line = readline("$ ");
+        
+        if (input_line == nullptr) {
+            // EOF or Ctrl+D
+            break;
+        }
+        
+        string input(input_line);
+        free(input_line); // Free the memory allocated by readline
+        
+        if (input.empty()) {
+            continue;
+        }
+        
+        // Keep reading while a compound command or quote is still open
+        std::unique_ptr<Node> tree;
+        string error;
+        ParseStatus status = parseInput(input, tree, error);
+        while (status == ParseStatus::Incomplete) {
+            char* continuation = readline("> ");
+            if (continuation == nullptr) {
+                break;
             }
+            input += "\n";
+            input += continuation;
+            free(continuation);
+            status = parseInput(input, tree, error);
+        }
+        
+        // Add to history if not empty
+        addHistoryLine(joinContinuationLines(input));
+        
+        if (status != ParseStatus::Ok) {
+            cerr << error << endl;
+            last_status = 2;
+            continue;
         }
+        
+        // Compile the whole input once, then run it
+        Program program;
+        Compiler compiler{program, false};
+        compiler.reserve(*tree);
+        compiler.compile(*tree);
+        runProgram(program);
     }
 
+    dumpShellStats();
     return 0;
 }